@@ -4,10 +4,21 @@
 
 /*
  * area-based allocation built on malloc/free
+ *
+ * An Area set up with ainit() keeps every block on a doubly linked list
+ * so that blocks can be freed individually.  An Area set up with
+ * ainit_temp() is meant for short lived (ATEMP) data: small blocks are
+ * carved out of larger chunks by bumping a pointer and are only really
+ * released by afreeall(); afree()/aresize() of the most recently
+ * allocated block shrink or grow it in place.  Large blocks in such an
+ * Area are still malloc()ed and linked individually.
+ *
+ * Each Area counts its live bytes and blocks (see c_memstat()).
  */
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "sh.h"
 
@@ -16,10 +27,55 @@ struct link {
 	struct link *next;
 };
 
+/* header just before every block */
+struct bhdr {
+	size_t	size;		/* usable size of block */
+	size_t	large;		/* block is malloc()ed and linked on its own */
+};
+
+struct chunk {
+	struct chunk *next;
+};
+
+#define ALIGNSZ		16	/* alignment of blocks */
+#define ROUNDUP(n)	(((n) + (ALIGNSZ - 1)) & ~(size_t)(ALIGNSZ - 1))
+
+#define BHDRSZ		ROUNDUP(sizeof(struct bhdr))
+#define LHDRSZ		ROUNDUP(sizeof(struct link) + sizeof(struct bhdr))
+#define CHDRSZ		ROUNDUP(sizeof(struct chunk))
+
+#define CHUNKSZ		8192	/* size of a chunk, including header */
+#define CHUNK_LARGE	1024	/* larger blocks are allocated on their own */
+#define NCACHED		16	/* chunks kept for reuse after afreeall() */
+
+static struct chunk *chunkcache;	/* chunks released by afreeall() */
+static int nchunkcache;
+
+static void	*talloc(size_t, Area *);
+static void	*lalloc(size_t, Area *);
+static void	 tfreeall(Area *);
+static void	 acount(Area *, size_t);
+static void	 auncount(Area *, size_t);
+static void	 arecount(Area *, size_t, size_t);
+
 Area *
 ainit(Area *ap)
 {
 	ap->freelist = NULL;
+	ap->chunks = NULL;
+	ap->bump = ap->limit = NULL;
+	ap->last = NULL;
+	ap->chunked = false;
+	ap->nbytes = ap->nblocks = ap->peak = 0;
+	ap->nalloc = ap->nfree = 0;
+	return ap;
+}
+
+Area *
+ainit_temp(Area *ap)
+{
+	ainit(ap);
+	ap->chunked = true;
 	return ap;
 }
 
@@ -28,26 +84,77 @@ afreeall(Area *ap)
 {
 	struct link *l, *l2;
 
+	if (ap->chunked)
+		tfreeall(ap);
 	for (l = ap->freelist; l != NULL; l = l2) {
 		l2 = l->next;
 		free(l);
 	}
 	ap->freelist = NULL;
+	ap->nfree += ap->nblocks;
+	ap->nbytes = ap->nblocks = 0;
 }
 
-#define L2P(l)	( (void *)(((char *)(l)) + sizeof(struct link)) )
-#define P2L(p)	( (struct link *)(((char *)(p)) - sizeof(struct link)) )
+/* a block's header sits just before it, a large block's link sits at the
+ * start of the malloc()ed memory.
+ */
+#define P2B(p)	( (struct bhdr *)(((char *)(p)) - sizeof(struct bhdr)) )
+#define P2L(p)	( (struct link *)(((char *)(p)) - LHDRSZ) )
 
 void *
 alloc(size_t size, Area *ap)
 {
-	struct link *l;
-
-	/* ensure that we don't overflow by allocating space for link */
-	if (size > SIZE_MAX - sizeof(struct link))
+	/* ensure that we don't overflow by rounding/adding headers */
+	if (size > SIZE_MAX - LHDRSZ - ALIGNSZ)
 		internal_errorf("unable to allocate memory");
 
-	l = malloc(sizeof(struct link) + size);
+	if (ap->chunked && size <= CHUNK_LARGE)
+		return talloc(size, ap);
+	return lalloc(size, ap);
+}
+
+/* allocate from the current chunk of a chunked Area */
+static void *
+talloc(size_t size, Area *ap)
+{
+	struct chunk *c;
+	struct bhdr *h;
+	char *p;
+
+	size = ROUNDUP(size);
+	if (ap->bump == NULL || (size_t)(ap->limit - ap->bump) <
+	    BHDRSZ + size) {
+		if ((c = chunkcache) != NULL) {
+			chunkcache = c->next;
+			nchunkcache--;
+		} else if ((c = malloc(CHUNKSZ)) == NULL)
+			internal_errorf("unable to allocate memory");
+		c->next = ap->chunks;
+		ap->chunks = c;
+		ap->bump = (char *)c + CHDRSZ;
+		ap->limit = (char *)c + CHUNKSZ;
+	}
+
+	p = ap->bump + BHDRSZ;
+	h = P2B(p);
+	h->size = size;
+	h->large = 0;
+	ap->bump = p + size;
+	ap->last = p;
+	acount(ap, size);
+
+	return p;
+}
+
+/* allocate a block on its own */
+static void *
+lalloc(size_t size, Area *ap)
+{
+	struct link *l;
+	struct bhdr *h;
+	char *p;
+
+	l = malloc(LHDRSZ + size);
 	if (l == NULL)
 		internal_errorf("unable to allocate memory");
 	l->next = ap->freelist;
@@ -56,7 +163,59 @@ alloc(size_t size, Area *ap)
 		ap->freelist->prev = l;
 	ap->freelist = l;
 
-	return L2P(l);
+	p = (char *)l + LHDRSZ;
+	h = P2B(p);
+	h->size = size;
+	h->large = 1;
+	acount(ap, size);
+
+	return p;
+}
+
+/* release the chunks of a chunked Area (large blocks are left to caller) */
+static void
+tfreeall(Area *ap)
+{
+	struct chunk *c, *c2;
+
+	for (c = ap->chunks; c != NULL; c = c2) {
+		c2 = c->next;
+		if (nchunkcache < NCACHED) {
+			c->next = chunkcache;
+			chunkcache = c;
+			nchunkcache++;
+		} else
+			free(c);
+	}
+	ap->chunks = NULL;
+	ap->bump = ap->limit = NULL;
+	ap->last = NULL;
+}
+
+static void
+acount(Area *ap, size_t size)
+{
+	ap->nalloc++;
+	ap->nblocks++;
+	ap->nbytes += size;
+	if (ap->nbytes > ap->peak)
+		ap->peak = ap->nbytes;
+}
+
+static void
+auncount(Area *ap, size_t size)
+{
+	ap->nfree++;
+	ap->nblocks--;
+	ap->nbytes -= size;
+}
+
+static void
+arecount(Area *ap, size_t osize, size_t nsize)
+{
+	ap->nbytes = ap->nbytes - osize + nsize;
+	if (ap->nbytes > ap->peak)
+		ap->peak = ap->nbytes;
 }
 
 /*
@@ -83,19 +242,39 @@ void *
 aresize(void *ptr, size_t size, Area *ap)
 {
 	struct link *l, *l2, *lprev, *lnext;
+	struct bhdr *h;
+	void *np;
 
 	if (ptr == NULL)
 		return alloc(size, ap);
 
-	/* ensure that we don't overflow by allocating space for link */
-	if (size > SIZE_MAX - sizeof(struct link))
+	/* ensure that we don't overflow by rounding/adding headers */
+	if (size > SIZE_MAX - LHDRSZ - ALIGNSZ)
 		internal_errorf("unable to allocate memory");
 
+	h = P2B(ptr);
+	if (!h->large) {
+		/* grow or shrink in place if this is the last block */
+		if (ptr == ap->last && size <= CHUNK_LARGE &&
+		    ROUNDUP(size) <= (size_t)(ap->limit - (char *)ptr)) {
+			arecount(ap, h->size, ROUNDUP(size));
+			h->size = ROUNDUP(size);
+			ap->bump = (char *)ptr + h->size;
+			return ptr;
+		}
+		if (size <= h->size)
+			return ptr;
+		np = alloc(size, ap);
+		memcpy(np, ptr, h->size);
+		auncount(ap, h->size);
+		return np;
+	}
+
 	l = P2L(ptr);
 	lprev = l->prev;
 	lnext = l->next;
 
-	l2 = realloc(l, sizeof(struct link) + size);
+	l2 = realloc(l, LHDRSZ + size);
 	if (l2 == NULL)
 		internal_errorf("unable to allocate memory");
 	if (lprev)
@@ -105,17 +284,33 @@ aresize(void *ptr, size_t size, Area *ap)
 	if (lnext)
 		lnext->prev = l2;
 
-	return L2P(l2);
+	np = (char *)l2 + LHDRSZ;
+	h = P2B(np);
+	arecount(ap, h->size, size);
+	h->size = size;
+	return np;
 }
 
 void
 afree(void *ptr, Area *ap)
 {
 	struct link *l;
+	struct bhdr *h;
 
 	if (!ptr)
 		return;
 
+	h = P2B(ptr);
+	auncount(ap, h->size);
+	if (!h->large) {
+		/* only the last block of a chunk can be given back */
+		if (ptr == ap->last) {
+			ap->bump = (char *)ptr - BHDRSZ;
+			ap->last = NULL;
+		}
+		return;
+	}
+
 	l = P2L(ptr);
 	if (l->prev)
 		l->prev->next = l->next;
@@ -560,7 +560,7 @@ c_typeset(char **wp)
 	struct block *l;
 	struct tbl *vp, **p;
 	int fset = 0, fclr = 0, thing = 0, func = 0, local = 0, pflag = 0;
-	const char *options = "L#R#UZ#fi#lprtux";	/* see comment below */
+	const char *options = "AL#R#SUZ#fi#lnprtux";	/* see comment below */
 	char *fieldstr, *basestr;
 	int field, base, optc, flag;
 
@@ -594,6 +594,9 @@ c_typeset(char **wp)
 	while ((optc = ksh_getopt(wp, &builtin_opt, options)) != -1) {
 		flag = 0;
 		switch (optc) {
+		case 'A':
+			flag = ASSOC;
+			break;
 		case 'L':
 			flag = LJUST;
 			fieldstr = builtin_opt.optarg;
@@ -602,6 +605,9 @@ c_typeset(char **wp)
 			flag = RJUST;
 			fieldstr = builtin_opt.optarg;
 			break;
+		case 'S':
+			flag = SHARED;
+			break;
 		case 'U':
 			/* at&t ksh uses u, but this conflicts with
 			 * upper/lower case.  If this option is changed,
@@ -623,6 +629,9 @@ c_typeset(char **wp)
 		case 'l':
 			flag = LCASEV;
 			break;
+		case 'n':
+			flag = NAMEREF;
+			break;
 		case 'p':
 			/* posix export/readonly -p flag.
 			 * typeset -p is the same as typeset (in pdksh);
@@ -680,6 +689,7 @@ c_typeset(char **wp)
 		 * At this point, flags in fset are cleared in fclr and vise
 		 * versa.  This property should be preserved.
 		 */
+		fclr &= ~ASSOC;		/* can't stop being associative */
 		if (fset & LCASEV)	/* LCASEV has priority over UCASEV_AL */
 			fset &= ~UCASEV_AL;
 		if (fset & LJUST)	/* LJUST has priority over RJUST */
@@ -688,6 +698,10 @@ c_typeset(char **wp)
 			fset |= RJUST;
 			fclr &= ~RJUST;
 		}
+		if (fset & SHARED) {	/* -S implies -i */
+			fset |= INTEGER;
+			fclr &= ~INTEGER;
+		}
 		/* Setting these attributes clears the others, unless they
 		 * are also set in this command
 		 */
@@ -746,16 +760,18 @@ c_typeset(char **wp)
 			}
 		}
 	} else {
+		importenv();
 		for (l = genv->loc; l; l = l->next) {
 			for (p = ktsort(&l->vars); (vp = *p++); ) {
-				struct tbl *tvp;
+				struct tbl **vpp, **list = arraylist(vp);
+				const char *name = vp->name;
 				int any_set = 0;
 				/*
 				 * See if the parameter is set (for arrays, if any
 				 * element is set).
 				 */
-				for (tvp = vp; tvp; tvp = tvp->u.array)
-					if (tvp->flag & ISSET) {
+				for (vpp = list; *vpp; vpp++)
+					if ((*vpp)->flag & ISSET) {
 						any_set = 1;
 						break;
 					}
@@ -773,7 +789,7 @@ c_typeset(char **wp)
 					continue;
 				if (flag && (vp->flag & flag) == 0)
 					continue;
-				for (; vp; vp = vp->u.array) {
+				for (vpp = list; (vp = *vpp); vpp++) {
 					/* Ignore array elements that aren't
 					 * set unless there are no set elements,
 					 * in which case the first is reported on */
@@ -789,6 +805,12 @@ c_typeset(char **wp)
 						 * be suitable for re-entry...
 						 */
 						shprintf("typeset ");
+						if ((vp->flag&ASSOC))
+							shprintf("-A ");
+						if ((vp->flag&NAMEREF))
+							shprintf("-n ");
+						if ((vp->flag&SHARED))
+							shprintf("-S ");
 						if ((vp->flag&INTEGER))
 							shprintf("-i ");
 						if ((vp->flag&EXPORT))
@@ -809,7 +831,7 @@ c_typeset(char **wp)
 							shprintf("-u ");
 						if ((vp->flag&INT_U))
 							shprintf("-U ");
-						shprintf("%s\n", vp->name);
+						shprintf("%s\n", name);
 						    if (vp->flag&ARRAY)
 						break;
 					} else {
@@ -817,11 +839,15 @@ c_typeset(char **wp)
 							shprintf("%s ",
 							    (flag & EXPORT) ?
 							    "export" : "readonly");
-						if ((vp->flag&ARRAY) && any_set)
+						if ((vp->flag&ARRAY) && any_set &&
+						    vp->index < 0)
+							shprintf("%s[%s]",
+							    name, vp->name);
+						else if ((vp->flag&ARRAY) && any_set)
 							shprintf("%s[%d]",
-							    vp->name, vp->index);
+							    name, vp->index);
 						else
-							shprintf("%s", vp->name);
+							shprintf("%s", name);
 						if (thing == '-' && (vp->flag&ISSET)) {
 							char *s = str_val(vp);
 
@@ -1014,22 +1040,19 @@ c_unalias(char **wp)
 			rv = 1;	/* POSIX */
 			continue;
 		}
-		if (ap->flag&ALLOC) {
-			ap->flag &= ~(ALLOC|ISSET);
+		if (ap->flag&ALLOC)
 			afree(ap->val.s, APERM);
-		}
-		ap->flag &= ~(DEFINED|ISSET|EXPORT);
+		ktdelete(t, ap);
 	}
 
 	if (all) {
-		struct tstate ts;
+		struct tbl **p;
 
-		for (ktwalk(&ts, t); (ap = ktnext(&ts)); ) {
-			if (ap->flag&ALLOC) {
-				ap->flag &= ~(ALLOC|ISSET);
+		/* ktdelete() moves entries around, so don't ktwalk() */
+		for (p = ktsort(t); (ap = *p++); ) {
+			if (ap->flag&ALLOC)
 				afree(ap->val.s, APERM);
-			}
-			ap->flag &= ~(DEFINED|ISSET|EXPORT);
+			ktdelete(t, ap);
 		}
 	}
 
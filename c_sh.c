@@ -647,13 +647,16 @@ int
 c_unset(char **wp)
 {
 	char *id;
-	int optc, unset_var = 1;
+	int optc, unset_var = 1, unset_ref = 0;
 
-	while ((optc = ksh_getopt(wp, &builtin_opt, "fv")) != -1)
+	while ((optc = ksh_getopt(wp, &builtin_opt, "fnv")) != -1)
 		switch (optc) {
 		case 'f':
 			unset_var = 0;
 			break;
+		case 'n':
+			unset_ref = 1;
+			break;
 		case 'v':
 			unset_var = 1;
 			break;
@@ -663,13 +666,16 @@ c_unset(char **wp)
 	wp += builtin_opt.optind;
 	for (; (id = *wp) != NULL; wp++)
 		if (unset_var) {	/* unset variable */
-			struct tbl *vp = global(id);
+			struct tbl *vp = unset_ref ? global_noref(id) :
+			    global(id);
 
 			if ((vp->flag&RDONLY)) {
-				bi_errorf("%s is read only", vp->name);
+				bi_errorf("%s is read only", VARNAME(vp));
 				return 1;
 			}
-			unset(vp, strchr(id, '[') ? 1 : 0);
+			/* a nameref may refer to an element */
+			unset(vp, strchr(id, '[') != NULL ||
+			    ((vp->flag & ARRAY) && vp->index != 0));
 		} else {		/* unset function */
 			define(id, NULL);
 		}
@@ -873,6 +879,123 @@ c_suspend(char **wp)
 	return 0;
 }
 
+static void
+p_area(int json, int *nrec, const char *kind, int level, const char *what,
+    Area *ap)
+{
+	if (json)
+		shprintf("%s{\"area\":\"%s\",\"level\":%d,\"type\":\"%s\","
+		    "\"bytes\":%lu,\"blocks\":%lu,\"peak\":%lu,"
+		    "\"allocs\":%lu,\"frees\":%lu}",
+		    (*nrec)++ ? "," : "", kind, level, what,
+		    (unsigned long)ap->nbytes, (unsigned long)ap->nblocks,
+		    (unsigned long)ap->peak, ap->nalloc, ap->nfree);
+	else
+		shprintf("%-6s%3d %-6s%12lu%9lu%12lu%12lu%12lu\n",
+		    kind, level, what,
+		    (unsigned long)ap->nbytes, (unsigned long)ap->nblocks,
+		    (unsigned long)ap->peak, ap->nalloc, ap->nfree);
+}
+
+static void
+p_table(int json, int *nrec, const char *name, int level,
+    struct table *tp)
+{
+	struct tstats st;
+	int i, load;
+
+	ktstats(tp, &st);
+	load = st.size ? (st.live + st.dead) * 100 / st.size : 0;
+	if (json) {
+		shprintf("%s{\"table\":\"%s\",\"level\":%d,\"size\":%d,"
+		    "\"oldsize\":%d,\"live\":%d,\"dead\":%d,\"load\":%d,"
+		    "\"hits\":%lu,\"misses\":%lu,\"maxprobe\":%d,"
+		    "\"probes\":[",
+		    (*nrec)++ ? "," : "", name, level, st.size,
+		    st.osize, st.live, st.dead, load, st.hits, st.misses,
+		    st.maxprobe);
+		for (i = 0; i < NPROBEHIST; i++)
+			shprintf("%s%d", i ? "," : "", st.probes[i]);
+		shprintf("]}");
+	} else {
+		shprintf("%-9s%3d%7d%7d%7d%5d%%%11lu%11lu%5d ",
+		    name, level, st.size, st.live, st.dead, load,
+		    st.hits, st.misses, st.maxprobe);
+		for (i = 0; i < NPROBEHIST; i++)
+			shprintf("%s%d", i ? "/" : "", st.probes[i]);
+		shprintf("\n");
+	}
+}
+
+/* report allocation counters of the permanent, environment and block areas,
+ * or the state of the hash tables
+ */
+static int
+c_memstat(char **wp)
+{
+	static const char *const env_types[] = {
+		"none", "parse", "func", "incl", "exec", "loop", "errh"
+	};
+	struct env *ep;
+	struct block *l;
+	int json = 0, tables = 0, nrec = 0;
+	int optc, i;
+
+	while ((optc = ksh_getopt(wp, &builtin_opt, "jt")) != -1)
+		switch (optc) {
+		case 'j':
+			json = 1;
+			break;
+		case 't':
+			tables = 1;
+			break;
+		case '?':
+			return 1;
+		}
+	if (wp[builtin_opt.optind]) {
+		bi_errorf("too many arguments");
+		return 1;
+	}
+
+	if (tables) {
+		if (json)
+			shprintf("[");
+		else
+			shprintf("%-9s%3s%7s%7s%7s%6s%11s%11s%5s %s\n",
+			    "TABLE", "LVL", "SIZE", "LIVE", "DEAD", "LOAD",
+			    "HITS", "MISSES", "MAXP", "PROBES 1/2/../8+");
+		p_table(json, &nrec, "builtins", 0, &builtins);
+		p_table(json, &nrec, "aliases", 0, &aliases);
+		p_table(json, &nrec, "taliases", 0, &taliases);
+		p_table(json, &nrec, "homedirs", 0, &homedirs);
+		p_table(json, &nrec, "keywords", 0, &keywords);
+		for (l = genv->loc, i = 0; l != NULL; l = l->next, i++) {
+			p_table(json, &nrec, "vars", i, &l->vars);
+			p_table(json, &nrec, "funs", i, &l->funs);
+		}
+		if (json)
+			shprintf("]\n");
+		return 0;
+	}
+
+	if (json)
+		shprintf("[");
+	else
+		shprintf("%-6s%3s %-6s%12s%9s%12s%12s%12s\n", "AREA", "LVL",
+		    "TYPE", "BYTES", "BLOCKS", "PEAK", "ALLOCS", "FREES");
+	p_area(json, &nrec, "aperm", 0, "-", APERM);
+	for (ep = genv, i = 0; ep != NULL; ep = ep->oenv, i++)
+		p_area(json, &nrec, "env", i, ep->type >= 0 &&
+		    ep->type < NELEM(env_types) ? env_types[ep->type] : "?",
+		    &ep->area);
+	for (l = genv->loc, i = 0; l != NULL; l = l->next, i++)
+		p_area(json, &nrec, "block", i,
+		    l->next ? "local" : "global", &l->area);
+	if (json)
+		shprintf("]\n");
+	return 0;
+}
+
 /* dummy function, special case in comexec() */
 int
 c_builtin(char **wp)
@@ -899,6 +1022,7 @@ const struct builtin shbuiltins [] = {
 	{"*=exec", c_exec},
 	{"*=exit", c_exitreturn},
 	{"+false", c_label},
+	{"memstat", c_memstat},
 	{"*=return", c_exitreturn},
 	{"*=set", c_set},
 	{"*=shift", c_shift},
@@ -37,8 +37,6 @@
 	operand ::= <any thing>
 */
 
-#define T_ERR_EXIT	2	/* POSIX says > 1 for errors */
-
 struct t_op {
 	char	op_text[4];
 	Test_op	op_num;
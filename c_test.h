@@ -31,6 +31,8 @@ enum Test_meta {
 };
 typedef enum Test_meta Test_meta;
 
+#define T_ERR_EXIT	2		/* POSIX says > 1 for errors */
+
 #define TEF_ERROR	BIT(0)		/* set if we've hit an error */
 #define TEF_DBRACKET	BIT(1)		/* set if [[ .. ]] test */
 
@@ -48,6 +50,18 @@ struct test_env {
 	void	(*error)(Test_env *, int, const char *);
 };
 
+/* A [[ .. ]] expression as parsed once by dbtest_compile() */
+typedef struct test_expr Test_expr;
+struct test_expr {
+	Test_meta meta;		/* TM_OR, TM_AND, TM_NOT, TM_UNOP or TM_BINOP */
+	Test_op	op;		/* the operator of TM_UNOP, TM_BINOP */
+	bool	literal;	/* = == != pattern has no special characters */
+	Test_expr *left, *right; /* operands of TM_OR, TM_AND, TM_NOT */
+	char	*opnd[2];	/* operand words (in struct op args) */
+	char	*plain[2];	/* operands as expanded, NULL where one
+				 * needs expanding */
+};
+
 Test_op	test_isop(Test_env *, Test_meta, const char *);
 int     test_eval(Test_env *, Test_op, const char *, const char *, int);
 int	test_parse(Test_env *);
@@ -651,7 +651,7 @@ x_try_array(const char *buf, int buflen, const char *want, int wantlen,
 	const char *cmd, *cp;
 	int cmdlen, n, i, slen;
 	char *name, *s;
-	struct tbl *v, *vp;
+	struct tbl *v, *vp, **vpp;
 
 	*nwords = 0;
 	*words = NULL;
@@ -695,7 +695,7 @@ x_try_array(const char *buf, int buflen, const char *want, int wantlen,
 	}
 
 	/* Walk the array and build words list. */
-	for (vp = v; vp; vp = vp->u.array) {
+	for (vpp = arraylist(v); (vp = *vpp) != NULL; vpp++) {
 		if (~vp->flag & ISSET)
 			continue;
 
@@ -51,9 +51,13 @@ typedef struct Expand {
 #define IFS_IWS		3	/* beginning of word, ignore IFS white-space */
 #define IFS_QUOTE	4	/* beg.w/quote, becomes IFS_WORD unless "$@" */
 
-static	int	varsub(Expand *, char *, char *, int *, int *);
+static	char   *dosubstitute(const char *, int, int);
+static	int	varsub(Expand *, char *, char *, int *, int *, int);
 static	int	comsub(Expand *, char *);
 static	char   *trimsub(char *, char *, int);
+static	char   *wdsep(char *, int);
+static	char   *wdpart(char *, char *, int);
+static	char   *strop(struct tbl *, char *, int, int);
 static	void	glob(char *, XPtrV *, int);
 static	void	globit(XString *, char **, char *, XPtrV *, int);
 static char	*maybe_expand_tilde(char *, XString *, char **, int);
@@ -66,6 +70,21 @@ static struct tbl *varcpy(struct tbl *);
 /* compile and expand word */
 char *
 substitute(const char *cp, int f)
+{
+	return dosubstitute(cp, ONEWORD, f);
+}
+
+/* compile and expand cp as a word that is not split: the key of an
+ * associative array
+ */
+char *
+keysubstitute(const char *cp)
+{
+	return dosubstitute(cp, ONEWORD|UNQUOTE, 0);
+}
+
+static char *
+dosubstitute(const char *cp, int cf, int f)
 {
 	struct source *s, *sold;
 
@@ -76,7 +95,7 @@ substitute(const char *cp, int f)
 	s = pushs(SWSTR, ATEMP);
 	s->start = s->str = cp;
 	source = s;
-	if (yylex(ONEWORD) != LWORD)
+	if (yylex(cf) != LWORD)
 		internal_errorf("substitute");
 	source = sold;
 	afree(s, ATEMP);
@@ -173,6 +192,7 @@ expand(char *cp,	/* input word */
 	int newlines = 0; /* For trailing newlines in COMSUB */
 	int saw_eq, tilde_ok;
 	int make_magic;
+	int lit = 0;		/* characters of a CHARS run left */
 	size_t len;
 
 	if (cp == NULL)
@@ -207,6 +227,11 @@ expand(char *cp,	/* input word */
 
 		switch (type) {
 		case XBASE:	/* original prefixed string */
+			if (lit > 0) {
+				lit--;
+				c = *sp++;
+				break;
+			}
 			c = *sp++;
 			switch (c) {
 			case EOS:
@@ -215,6 +240,22 @@ expand(char *cp,	/* input word */
 			case CHAR:
 				c = *sp++;
 				break;
+			case CHARS:
+				len = (unsigned char)*sp++;
+				if (!quote && (f & DOBLANK) && doblank) {
+					/* $IFS applies, one at a time */
+					lit = len - 1;
+					c = *sp++;
+					break;
+				}
+				/* nothing to mark, split or expand */
+				XcheckN(ds, dp, len);
+				memcpy(dp, sp, len);
+				dp += len;
+				sp += len;
+				tilde_ok = 0;
+				word = IFS_WORD;
+				continue;
 			case QCHAR:
 				quote |= 2; /* temporary quote */
 				c = *sp++;
@@ -271,6 +312,7 @@ expand(char *cp,	/* input word */
 
 					v.flag = DEFINED|ISSET|INTEGER;
 					v.type = 10; /* not default */
+					v.areap = ATEMP;
 					v.name[0] = '\0';
 					v_evaluate(&v, substitute(sp, 0),
 					    KSH_UNWIND_ERROR, true);
@@ -293,7 +335,8 @@ expand(char *cp,	/* input word */
 				int slen = 0;
 
 				sp = strchr(sp, '\0') + 1; /* skip variable */
-				type = varsub(&x, varname, sp, &stype, &slen);
+				type = varsub(&x, varname, sp, &stype, &slen,
+				    f);
 				if (type < 0) {
 					char endc;
 					char *str, *end;
@@ -458,7 +501,7 @@ expand(char *cp,	/* input word */
 				    {
 					char *s = Xrestpos(ds, dp, st->base);
 
-					errorf("%s: %s", st->var->name,
+					errorf("%s: %s", VARNAME(st->var),
 					    dp == s ?
 					    "parameter null or not set" :
 					    (debunk(s, s, strlen(s) + 1), s));
@@ -501,6 +544,26 @@ expand(char *cp,	/* input word */
 
 		case XSUB:
 		case XSUBMID:
+			/* copy what needs no marking or splitting at once */
+			if (type == XSUBMID && (quote ||
+			    (!(f & (DOPAT|DOGLOB|DOBRACE_)) &&
+			    !((f & DOBLANK) && doblank)))) {
+				static const char qstop[] = { MAGIC, '\0' };
+				static const char ustop[] = {
+					MAGIC, '=', ':', '\0'
+				};
+
+				len = strcspn(x.str, quote ? qstop : ustop);
+				if (len > 0) {
+					XcheckN(ds, dp, len);
+					memcpy(dp, x.str, len);
+					dp += len;
+					x.str += len;
+					tilde_ok = 0;
+					word = IFS_WORD;
+					continue;
+				}
+			}
 			if ((c = *x.str++) == 0) {
 				type = XBASE;
 				if (f&DOBLANK)
@@ -736,7 +799,8 @@ done:
 static int
 varsub(Expand *xp, char *sp, char *word,
     int *stypep,	/* becomes qualifier type */
-    int *slenp)		/* " " len (=, :=, etc.) valid iff *stypep != 0 */
+    int *slenp,		/* " " len (=, :=, etc.) valid iff *stypep != 0 */
+    int f)
 {
 	int c;
 	int state;	/* next state: XBASE, XARG, XSUB, XNULLSUB */
@@ -759,19 +823,20 @@ varsub(Expand *xp, char *sp, char *word,
 		sp++;
 		/* Check for size of array */
 		if ((p=strchr(sp,'[')) && (p[1]=='*'||p[1]=='@') && p[2]==']') {
+			struct tbl **vpp;
 			int n = 0;
 
 			vp = global(arrayname(sp));
 			if (vp->flag & (ISSET|ARRAY))
 				zero_ok = 1;
-			for (; vp; vp = vp->u.array)
+			for (vpp = arraylist(vp); (vp = *vpp) != NULL; vpp++)
 				if (vp->flag & ISSET)
 					n++;
 			c = n; /* ksh88/ksh93 go for number, not max index */
 		} else if (c == '*' || c == '@')
 			c = genv->loc->argc;
 		else {
-			p = str_val(global(sp));
+			p = str_val(global_peek(sp));
 			zero_ok = p != null;
 			c = strlen(p);
 		}
@@ -800,8 +865,21 @@ varsub(Expand *xp, char *sp, char *word,
 			stype |= 0x80;
 			slen += 2;
 		}
-	} else if (stype)	/* : is not ok */
-		return -1;
+	} else if (stype) {	/* ${var:offset[:length]} */
+		if (word[slen] == CSUBST)
+			return -1;
+		stype = ':';
+	} else if (c == '/' || c == '^' || c == ',') {
+		/* the / of // (and /#, /%) is left to strop() */
+		slen += 2;
+		stype = c;
+		if (c != '/' && word[slen] == CHAR && word[slen + 1] == c) {
+			stype |= 0x80;
+			slen += 2;
+		}
+		if (c != '/' && word[slen] != CSUBST)
+			return -1;
+	}
 	if (!stype && *word != CSUBST)
 		return -1;
 	*stypep = stype;
@@ -813,6 +891,10 @@ varsub(Expand *xp, char *sp, char *word,
 		case '=':	/* can't assign to a vector */
 		case '%':	/* can't trim a vector (yet) */
 		case '#':
+		case ':':
+		case '/':
+		case '^':
+		case ',':
 			return -1;
 		}
 		if (genv->loc->argc == 0) {
@@ -827,22 +909,38 @@ varsub(Expand *xp, char *sp, char *word,
 		}
 		zero_ok = 1;	/* exempt "$@" and "$*" from 'set -u' */
 	} else {
+		/* ${!name[@]}, the subscripts of an array */
+		int keys = c == '!' && sp[1] != '\0';
+
 		if ((p=strchr(sp,'[')) && (p[1]=='*'||p[1]=='@') && p[2]==']') {
 			XPtrV wv;
+			struct tbl **vpp;
 
 			switch (stype & 0x7f) {
 			case '=':	/* can't assign to a vector */
 			case '%':	/* can't trim a vector (yet) */
 			case '#':
 			case '?':
+			case ':':
+			case '/':
+			case '^':
+			case ',':
 				return -1;
 			}
+			if (keys && stype)
+				return -1;
 			XPinit(wv, 32);
-			vp = global(arrayname(sp));
-			for (; vp; vp = vp->u.array) {
+			vp = global(arrayname(sp + keys));
+			for (vpp = arraylist(vp); (vp = *vpp) != NULL; vpp++) {
 				if (!(vp->flag&ISSET))
 					continue;
-				XPput(wv, str_val(vp));
+				if (!keys)
+					XPput(wv, str_val(vp));
+				else if (vp->index < 0)
+					XPput(wv, vp->name);
+				else
+					XPput(wv, str_save(u64ton(vp->index,
+					    10), ATEMP));
 			}
 			if (XPsize(wv) == 0) {
 				xp->str = null;
@@ -855,13 +953,24 @@ varsub(Expand *xp, char *sp, char *word,
 				xp->split = p[1] == '@'; /* ${foo[@]} */
 				state = XARG;
 			}
+		} else if (keys) {
+			/* ${!name}, the variable a nameref refers to */
+			if (stype || strchr(sp, '[') != NULL)
+				return -1;
+			xp->var = global_noref(sp + 1);
+			xp->str = (xp->var->flag & (NAMEREF|ISSET)) ==
+			    (NAMEREF|ISSET) ? str_val(xp->var) : xp->var->name;
+			state = XSUB;
 		} else {
 			/* Can't assign things like $! or $1 */
 			if ((stype & 0x7f) == '=' &&
 			    (ctype(*sp, C_VAR1) || digit(*sp)))
 				return -1;
-			xp->var = global(sp);
+			/* only ${var=word} may create an element */
+			xp->var = (stype & 0x7f) == '=' ? global(sp) :
+			    global_peek(sp);
 			xp->str = str_val(xp->var);
+			varshare(xp->var);
 			state = XSUB;
 		}
 	}
@@ -875,9 +984,165 @@ varsub(Expand *xp, char *sp, char *word,
 	if (Flag(FNOUNSET) && xp->str == null && !zero_ok &&
 	    (ctype(c, C_SUBOP2) || (state != XBASE && c != '+')))
 		errorf("%s: parameter not set", sp);
+	if (c == ':' || c == '/' || c == '^' || c == ',')
+		xp->str = strop(xp->var, word + slen, stype, f);
 	return state;
 }
 
+/*
+ * Find the first unquoted c outside nested substitutions and patterns in
+ * the word part of a ${}, else its CSUBST.  When looking for a :, those
+ * of ?: expressions are passed over.
+ */
+static char *
+wdsep(char *wp, int c)
+{
+	int nest = 0, cond = 0;
+
+	while (1)
+		switch (*wp) {
+		case CHAR:
+			if (nest == 0) {
+				if (wp[1] == c && (c != ':' || cond-- == 0))
+					return wp;
+				if (wp[1] == '?')
+					cond++;
+			}
+			wp += 2;
+			break;
+		case QCHAR:
+			wp += 2;
+			break;
+		case CHARS:
+			wp += 2 + (unsigned char)wp[1];
+			break;
+		case COMSUB:
+		case EXPRSUB:
+			wp = strchr(wp + 1, '\0') + 1;
+			break;
+		case OSUBST:
+			nest++;
+			wp = strchr(wp + 1, '\0') + 1;
+			break;
+		case CSUBST:
+			if (nest-- == 0)
+				return wp;
+			wp += 2;
+			break;
+		case OPAT:
+			nest++;
+			wp += 2;
+			break;
+		case CPAT:
+			nest--;
+			/* FALLTHROUGH */
+		default:	/* OQUOTE, CQUOTE, SPAT */
+			wp++;
+			break;
+		}
+}
+
+/*
+ * Expand the part of a ${} word from wp up to (not including) end.
+ */
+static char *
+wdpart(char *wp, char *end, int f)
+{
+	char *cp;
+
+	/* not str_nsave(): variable names in the word end with a \0 */
+	cp = alloc(end - wp + 1, ATEMP);
+	memcpy(cp, wp, end - wp);
+	cp[end - wp] = EOS;
+	return evalstr(cp, f);
+}
+
+/*
+ * ${var:offset[:length]}, ${var/pattern/string} (and //, /#, /%),
+ * ${var^}, ${var^^}, ${var,} and ${var,,}: compute the value of vp with
+ * the operator applied.  word is what follows the operator.
+ */
+static char *
+strop(struct tbl *vp, char *word, int stype, int f)
+{
+	char *str, *pat, *rep, *end, *p;
+	int64_t off, len;
+	int how, n, m, slen, rlen;
+	XString xs;
+	char *xp;
+
+	f = (f & DONTRUNCOMMAND) | DOTEMP_;
+	switch (stype & 0x7f) {
+	case ':':
+		end = wdsep(word, ':');
+		evaluate(wdpart(word, end, f), &off, KSH_UNWIND_ERROR, true);
+		if (*end == CHAR)
+			evaluate(wdpart(end + 2, wdsep(end + 2, 0), f), &len,
+			    KSH_UNWIND_ERROR, true);
+		/* the value is fetched last, in case the above assigned it */
+		str = str_val(vp);
+		slen = strlen(str);
+		if (off < 0 && (off += slen) < 0)
+			off = 0;
+		if (off > slen)
+			off = slen;
+		if (*end != CHAR)
+			len = slen - off;
+		else if (len < 0 && (len += slen - off) < 0)
+			len = 0;
+		if (len > slen - off)
+			len = slen - off;
+		return str_nsave(str + off, len, ATEMP);
+
+	case '/':
+		/* how: '/' first match, 0x80|'/' all, '#' prefix, '%' suffix */
+		how = stype;
+		if (word[0] == CHAR && (word[1] == '/' || word[1] == '#' ||
+		    word[1] == '%')) {
+			how = word[1] == '/' ? 0x80|'/' : word[1];
+			word += 2;
+		}
+		end = wdsep(word, '/');
+		pat = wdpart(word, end, f | DOPAT);
+		rep = *end == CHAR ? wdpart(end + 2, wdsep(end + 2, 0),
+		    f | DOTILDE) : null;
+		str = str_val(vp);
+		slen = strlen(str);
+		rlen = strlen(rep);
+		Xinit(xs, xp, slen + 1, ATEMP);
+		p = str;
+		do {
+			if (how == '#' || how == '%') {
+				if ((m = gmatch_trim(str, pat, how == '%',
+				    true)) < 0)
+					break;
+				n = how == '#' ? 0 : slen - m;
+			} else if ((n = gmatch_search(p, str + slen - p, pat,
+			    &m)) < 0)
+				break;
+			XcheckN(xs, xp, n + rlen);
+			memcpy(xp, p, n);
+			memcpy(xp + n, rep, rlen);
+			xp += n + rlen;
+			p += n + m;
+		} while (how == (0x80|'/') && *p != '\0');
+		n = str + slen - p;
+		XcheckN(xs, xp, n + 1);
+		memcpy(xp, p, n + 1);
+		return Xclose(xs, xp + n + 1);
+
+	default:	/* ^ and , */
+		str = str_save(str_val(vp), ATEMP);
+		for (p = str; *p != '\0'; p++) {
+			*p = (stype & 0x7f) == '^' ? toupper((unsigned char)*p) :
+			    tolower((unsigned char)*p);
+			if (!(stype & 0x80))
+				break;
+		}
+		return str;
+	}
+}
+
 /*
  * Run the command in $(...) and read its output.
  */
@@ -938,45 +1203,15 @@ comsub(Expand *xp, char *cp)
 static char *
 trimsub(char *str, char *pat, int how)
 {
-	char *end = strchr(str, 0);
-	char *p, c;
-
-	switch (how&0xff) {	/* UCHAR_MAX maybe? */
-	case '#':		/* shortest at beginning */
-		for (p = str; p <= end; p++) {
-			c = *p; *p = '\0';
-			if (gmatch_(str, pat, false)) {
-				*p = c;
-				return p;
-			}
-			*p = c;
-		}
-		break;
-	case '#'|0x80:	/* longest match at beginning */
-		for (p = end; p >= str; p--) {
-			c = *p; *p = '\0';
-			if (gmatch_(str, pat, false)) {
-				*p = c;
-				return p;
-			}
-			*p = c;
-		}
-		break;
-	case '%':		/* shortest match at end */
-		for (p = end; p >= str; p--) {
-			if (gmatch_(p, pat, false))
-				return str_nsave(str, p - str, ATEMP);
-		}
-		break;
-	case '%'|0x80:	/* longest match at end */
-		for (p = str; p <= end; p++) {
-			if (gmatch_(p, pat, false))
-				return str_nsave(str, p - str, ATEMP);
-		}
-		break;
-	}
-
-	return str;		/* no match, return string */
+	int n;
+
+	/* # and ## remove a prefix, % and %% a suffix; doubled is longest */
+	n = gmatch_trim(str, pat, (how & 0x7f) == '%', (how & 0x80) != 0);
+	if (n < 0)
+		return str;	/* no match, return string */
+	if ((how & 0x7f) == '#')
+		return str + n;
+	return str_nsave(str, strlen(str) - n, ATEMP);
 }
 
 /*
@@ -1185,11 +1420,19 @@ maybe_expand_tilde(char *p, XString *dsp, char **dpp, int isassign)
 
 	Xinit(ts, tp, 16, ATEMP);
 	/* : only for DOASNTILDE form */
-	while (p[0] == CHAR && p[1] != '/' && (!isassign || p[1] != ':'))
-	{
-		Xcheck(ts, tp);
-		*tp++ = p[1];
-		p += 2;
+	while (1) {
+		if (p[0] == CHAR && p[1] != '/' && (!isassign || p[1] != ':')) {
+			Xcheck(ts, tp);
+			*tp++ = p[1];
+			p += 2;
+		} else if (p[0] == CHARS) {
+			/* no / or : in there */
+			XcheckN(ts, tp, (unsigned char)p[1]);
+			memcpy(tp, p + 2, (unsigned char)p[1]);
+			tp += (unsigned char)p[1];
+			p += 2 + (unsigned char)p[1];
+		} else
+			break;
 	}
 	*tp = '\0';
 	r = (p[0] == EOS || p[0] == CHAR || p[0] == CSUBST) ?
@@ -33,6 +33,13 @@ static const char *dbteste_getopnd(Test_env *, Test_op, int);
 static int	dbteste_eval(Test_env *, Test_op, const char *, const char *,
 		    int);
 static void	dbteste_error(Test_env *, int, const char *);
+static int	dbteste_run(Test_env *, Test_expr *);
+static Test_expr *dbtestc_oexpr(Test_env *, Area *);
+static Test_expr *dbtestc_aexpr(Test_env *, Area *);
+static Test_expr *dbtestc_nexpr(Test_env *, Area *);
+static Test_expr *dbtestc_primary(Test_env *, Area *);
+static Test_expr *dbtestc_node(Test_meta, Test_op, Area *);
+static void	dbtestc_opnd(Test_expr *, int, char *, Test_op, Area *);
 
 
 /*
@@ -45,13 +52,14 @@ execute(struct op *volatile t,
 				 * short-circuit && or || shouldn't be treated
 				 * as an error */
 {
-	int i, dummy = 0, save_xerrok = 0;
+	int i, j, arm, dummy = 0, save_xerrok = 0;
 	volatile int rv = 0;
 	int pv[2];
 	char ** volatile ap;
 	char *s, *cp;
 	struct ioword **iowp;
 	struct tbl *tp = NULL;
+	struct casetab *ct;
 
 	if (t == NULL)
 		return 0;
@@ -86,7 +94,17 @@ execute(struct op *volatile t,
 		/* POSIX says expand command words first, then redirections,
 		 * and assignments last..
 		 */
-		ap = eval(t->args, t->u.evalflags | DOBLANK | DOGLOB | DOTILDE);
+		if (t->pargs != NULL) {
+			/* nothing to expand, see get_command() */
+			for (i = 0; t->pargs[i] != NULL; i++)
+				;
+			ap = areallocarray(NULL, i + 1, sizeof(char *), ATEMP);
+			for (i = 0; t->pargs[i] != NULL; i++)
+				ap[i] = str_save(t->pargs[i], ATEMP);
+			ap[i] = NULL;
+		} else
+			ap = eval(t->args,
+			    t->u.evalflags | DOBLANK | DOGLOB | DOTILDE);
 		if (flags & XTIME)
 			/* Allow option parsing (bizarre, but POSIX) */
 			timex_hook(t, &ap);
@@ -266,7 +284,11 @@ execute(struct op *volatile t,
 		te.eval = dbteste_eval;
 		te.error = dbteste_error;
 
-		rv = test_parse(&te);
+		if (t->texpr != NULL) {
+			rv = dbteste_run(&te, t->texpr);
+			rv = (te.flags & TEF_ERROR) ? T_ERR_EXIT : !rv;
+		} else
+			rv = test_parse(&te);
 		break;
 	    }
 
@@ -347,10 +369,26 @@ execute(struct op *volatile t,
 
 	case TCASE:
 		cp = evalstr(t->str, DOTILDE);
-		for (t = t->left; t != NULL && t->type == TPAT; t = t->right) {
-			for (ap = t->vars; *ap; ap++) {
-				if ((s = evalstr(*ap, DOTILDE|DOPAT)) &&
-				    gmatch_(cp, s, false))
+		/* literal patterns are looked up at once, if hashed: only
+		 * the arm found need compare them (after expanding the
+		 * patterns before them, in order)
+		 */
+		ct = t->ctab;
+		arm = ct != NULL ? caselookup(ct, cp) : -1;
+		for (i = 0, t = t->left; t != NULL && t->type == TPAT;
+		    i++, t = t->right) {
+			for (j = 0, ap = t->vars; *ap; j++, ap++) {
+				if (t->pargs != NULL && t->pargs[j] != NULL) {
+					if ((ct == NULL || i == arm) &&
+					    !strcmp(cp, t->pargs[j]))
+						goto Found;
+					continue;
+				}
+				if (t->pvars != NULL && t->pvars[j] != NULL)
+					s = t->pvars[j];
+				else
+					s = evalstr(*ap, DOTILDE|DOPAT);
+				if (gmatch_(cp, s, false))
 					goto Found;
 			}
 		}
@@ -409,8 +447,10 @@ comexec(struct op *t, struct tbl *volatile tp, char **ap, volatile int flags,
 {
 	int i;
 	volatile int rv = 0;
-	char *cp;
-	char **lastp;
+	char *cp, *p;
+	char **lastp, **vals;
+	bool append = false;
+	struct tbl *vp;
 	struct op texec;
 	int type_flags;
 	int keepasn_ok;
@@ -511,19 +551,50 @@ comexec(struct op *t, struct tbl *volatile tp, char **ap, volatile int flags,
 	if (Flag(FEXPORT))
 		type_flags |= EXPORT;
 	for (i = 0; t->vars[i]; i++) {
-		cp = evalstr(t->vars[i], DOASNTILDE);
+		vals = NULL;
+		if ((p = wdarray(t->vars[i])) != NULL) {
+			/* name=(...) or name+=(...), never before a command
+			 * (see get_command())
+			 */
+			vals = eval(wditems(p), DOBLANK|DOGLOB|DOTILDE);
+			cp = wdstrip(t->vars[i]);
+			p = skip_varname(cp, false);
+			append = *p == '+';
+			*p = '\0';
+		} else if (t->pvars != NULL && t->pvars[i] != NULL)
+			cp = t->pvars[i];
+		else
+			cp = evalstr(t->vars[i], DOASNTILDE);
 		if (Flag(FXTRACE)) {
 			if (i == 0)
 				shf_fprintf(shl_out, "%s",
 				    PS4_SUBSTITUTE(str_val(global("PS4"))));
-			shf_fprintf(shl_out, "%s%s", cp,
+			if (vals != NULL) {
+				shf_fprintf(shl_out, "%s%s=(", cp,
+				    append ? "+" : "");
+				for (lastp = vals; *lastp; lastp++)
+					shf_fprintf(shl_out, "%s%s", *lastp,
+					    lastp[1] ? " " : "");
+				shf_putc(')', shl_out);
+			} else
+				shf_fprintf(shl_out, "%s", cp);
+			shf_fprintf(shl_out, "%s",
 			    t->vars[i + 1] ? " " : "\n");
 			if (!t->vars[i + 1])
 				shf_flush(shl_out);
 		}
-		typeset(cp, type_flags, 0, 0, 0);
-		if (bourne_function_call && !(type_flags & EXPORT))
+		if (vals != NULL) {
+			set_array(cp, 1, append, vals);
+			continue;
+		}
+		vp = typeset(cp, type_flags, 0, 0, 0);
+		if (bourne_function_call && !(type_flags & EXPORT)) {
+			/* FOO+=bar is done, the copy gets the result */
+			if (*(p = skip_varname(cp, true)) == '+')
+				cp = shf_smprintf("%.*s=%s", (int)(p - cp), cp,
+				    str_val(vp));
 			typeset(cp, LOCAL|LOCAL_COPY|EXPORT, 0, 0, 0);
+		}
 	}
 
 	if ((cp = *ap) == NULL) {
@@ -622,15 +693,13 @@ comexec(struct op *t, struct tbl *volatile tp, char **ap, volatile int flags,
 		Flag(FXTRACE) = old_xflag;
 		tp->flag = (tp->flag & ~FINUSE) | old_inuse;
 		/* Were we deleted while executing?  If so, free the execution
-		 * tree.  todo: Unfortunately, the table entry is never re-used
-		 * until the lookup table is expanded.
+		 * tree and the entry, define() already took it out of the
+		 * function table.
 		 */
 		if ((tp->flag & (FDELETE|FINUSE)) == FDELETE) {
-			if (tp->flag & ALLOC) {
-				tp->flag &= ~ALLOC;
+			if (tp->flag & ALLOC)
 				tfree(tp->val.t, tp->areap);
-			}
-			tp->flag = 0;
+			tbfree(tp);
 		}
 		switch (i) {
 		case LRETURN:
@@ -691,6 +760,8 @@ comexec(struct op *t, struct tbl *volatile tp, char **ap, volatile int flags,
 		texec.left = t;	/* for tprint */
 		texec.str = tp->val.s;
 		texec.args = ap;
+		/* so the child finds most of its environment made */
+		cacheenv();
 		rv = exchild(&texec, flags, xerrok, -1);
 		break;
 	}
@@ -765,6 +836,7 @@ findfunc(const char *name, unsigned int h, int create)
 int
 define(const char *name, struct op *t)
 {
+	struct block *l;
 	struct tbl *tp;
 	int was_set = 0;
 
@@ -773,13 +845,16 @@ define(const char *name, struct op *t)
 
 		if (tp->flag & ISSET)
 			was_set = 1;
-		/* If this function is currently being executed, we zap this
-		 * table entry so findfunc() won't see it
+		/* If this function is currently being executed, we take
+		 * it out of the table so findfunc() won't see it; comexec()
+		 * frees it when it returns.
 		 */
 		if (tp->flag & FINUSE) {
-			tp->name[0] = '\0';
-			tp->flag &= ~DEFINED; /* ensure it won't be found */
+			tp->flag &= ~DEFINED;
 			tp->flag |= FDELETE;
+			for (l = genv->loc; l->next; l = l->next)
+				;
+			ktdelete(&l->funs, tp);
 		} else
 			break;
 	}
@@ -790,7 +865,9 @@ define(const char *name, struct op *t)
 	}
 
 	if (t == NULL) {		/* undefine */
-		ktdelete(tp);
+		for (l = genv->loc; l->next; l = l->next)
+			;
+		ktdelete(&l->funs, tp);
 		return was_set ? 0 : 1;
 	}
 
@@ -1362,17 +1439,29 @@ dbteste_isa(Test_env *te, Test_meta meta)
 		return meta == TM_END;
 
 	/* unquoted word? */
-	for (p = *te->pos.wp; *p == CHAR; p += 2)
-		;
+	for (p = *te->pos.wp; *p == CHAR || *p == CHARS; )
+		p += *p == CHAR ? 2 : 2 + (unsigned char)p[1];
 	uqword = *p == EOS;
 
 	if (meta == TM_UNOP || meta == TM_BINOP) {
 		if (uqword) {
 			char buf[8];	/* longer than the longest operator */
-			char *q = buf;
-			for (p = *te->pos.wp;
-			    *p == CHAR && q < &buf[sizeof(buf) - 1]; p += 2)
-				*q++ = p[1];
+			char *q = buf, *s;
+			int n;
+
+			for (p = *te->pos.wp; *p != EOS; p = s + n) {
+				if (*p == CHAR) {
+					s = p + 1;
+					n = 1;
+				} else {
+					s = p + 2;
+					n = (unsigned char)p[1];
+				}
+				if (n > &buf[sizeof(buf) - 1] - q)
+					break;
+				memcpy(q, s, n);
+				q += n;
+			}
 			*q = '\0';
 			ret = (int) test_isop(te, meta, buf);
 		}
@@ -1423,3 +1512,187 @@ dbteste_error(Test_env *te, int offset, const char *msg)
 	te->flags |= TEF_ERROR;
 	internal_warningf("%s: %s (offset %d)", __func__, msg, offset);
 }
+
+/* Evaluate expression e, as test_parse() would its words. */
+static int
+dbteste_run(Test_env *te, Test_expr *e)
+{
+	const char *opnd1, *opnd2 = NULL;
+	int res;
+
+	switch (e->meta) {
+	case TM_OR:
+		res = dbteste_run(te, e->left);
+		if (!res && !(te->flags & TEF_ERROR))
+			res = dbteste_run(te, e->right);
+		return res;
+	case TM_AND:
+		res = dbteste_run(te, e->left);
+		if (res && !(te->flags & TEF_ERROR))
+			res = dbteste_run(te, e->right);
+		return res;
+	case TM_NOT:
+		return !dbteste_run(te, e->left);
+	default:
+		break;
+	}
+
+	if ((opnd1 = e->plain[0]) == NULL)
+		opnd1 = evalstr(e->opnd[0], DOTILDE);
+	if (e->meta == TM_BINOP) {
+		if ((opnd2 = e->plain[1]) == NULL)
+			opnd2 = evalstr(e->opnd[1],
+			    e->op == TO_STEQL || e->op == TO_STNEQ ?
+			    DOTILDE | DOPAT : DOTILDE);
+		if (e->literal)
+			return (strcmp(opnd1, opnd2) == 0) ==
+			    (e->op == TO_STEQL);
+	}
+	return test_eval(te, e->op, opnd1, opnd2, 1);
+}
+
+/*
+ * Parse the words of a [[ .. ]] (as checked by syn.c) once, so execute()
+ * need not on every run.  Returns NULL if the words do not parse.
+ */
+struct test_expr *
+dbtest_compile(char **args, Area *ap)
+{
+	Test_env te;
+	Test_expr *e;
+
+	te.flags = TEF_DBRACKET;
+	te.pos.wp = args;
+	te.isa = dbteste_isa;
+	te.getopnd = dbteste_getopnd;
+	te.eval = dbteste_eval;
+	te.error = dbteste_error;
+
+	e = dbtestc_oexpr(&te, ap);
+	if ((te.flags & TEF_ERROR) || !dbteste_isa(&te, TM_END)) {
+		dbtest_free(e, ap);
+		return NULL;
+	}
+	return e;
+}
+
+void
+dbtest_free(struct test_expr *e, Area *ap)
+{
+	if (e == NULL)
+		return;
+	dbtest_free(e->left, ap);
+	dbtest_free(e->right, ap);
+	afree(e->plain[0], ap);
+	afree(e->plain[1], ap);
+	afree(e, ap);
+}
+
+/* The dbtestc_* routines follow test_oexpr() and friends in c_test.c. */
+static Test_expr *
+dbtestc_oexpr(Test_env *te, Area *ap)
+{
+	Test_expr *e, *l;
+
+	l = dbtestc_aexpr(te, ap);
+	if ((te->flags & TEF_ERROR) || !dbteste_isa(te, TM_OR))
+		return l;
+	e = dbtestc_node(TM_OR, TO_NONOP, ap);
+	e->left = l;
+	e->right = dbtestc_oexpr(te, ap);
+	return e;
+}
+
+static Test_expr *
+dbtestc_aexpr(Test_env *te, Area *ap)
+{
+	Test_expr *e, *l;
+
+	l = dbtestc_nexpr(te, ap);
+	if ((te->flags & TEF_ERROR) || !dbteste_isa(te, TM_AND))
+		return l;
+	e = dbtestc_node(TM_AND, TO_NONOP, ap);
+	e->left = l;
+	e->right = dbtestc_aexpr(te, ap);
+	return e;
+}
+
+static Test_expr *
+dbtestc_nexpr(Test_env *te, Area *ap)
+{
+	Test_expr *e;
+
+	if (!dbteste_isa(te, TM_NOT))
+		return dbtestc_primary(te, ap);
+	e = dbtestc_node(TM_NOT, TO_NONOP, ap);
+	e->left = dbtestc_nexpr(te, ap);
+	return e;
+}
+
+static Test_expr *
+dbtestc_primary(Test_env *te, Area *ap)
+{
+	Test_expr *e;
+	Test_op op;
+	char *opnd1;
+
+	if (dbteste_isa(te, TM_OPAREN)) {
+		e = dbtestc_oexpr(te, ap);
+		if (!(te->flags & TEF_ERROR) && !dbteste_isa(te, TM_CPAREN))
+			te->flags |= TEF_ERROR;
+		return e;
+	}
+	if ((op = (Test_op) dbteste_isa(te, TM_UNOP))) {
+		if (*te->pos.wp == NULL) {
+			te->flags |= TEF_ERROR;
+			return NULL;
+		}
+		e = dbtestc_node(TM_UNOP, op, ap);
+		dbtestc_opnd(e, 0, *te->pos.wp++, op, ap);
+		return e;
+	}
+	if ((opnd1 = *te->pos.wp) == NULL) {
+		te->flags |= TEF_ERROR;
+		return NULL;
+	}
+	te->pos.wp++;
+	if (!(op = (Test_op) dbteste_isa(te, TM_BINOP)) ||
+	    *te->pos.wp == NULL) {
+		te->flags |= TEF_ERROR;
+		return NULL;
+	}
+	e = dbtestc_node(TM_BINOP, op, ap);
+	dbtestc_opnd(e, 0, opnd1, TO_NONOP, ap);
+	dbtestc_opnd(e, 1, *te->pos.wp++, op, ap);
+	return e;
+}
+
+static Test_expr *
+dbtestc_node(Test_meta meta, Test_op op, Area *ap)
+{
+	Test_expr *e;
+
+	e = alloc(sizeof(*e), ap);
+	e->meta = meta;
+	e->op = op;
+	e->literal = false;
+	e->left = e->right = NULL;
+	e->opnd[0] = e->opnd[1] = NULL;
+	e->plain[0] = e->plain[1] = NULL;
+	return e;
+}
+
+/* Set operand i of e to word wp, expanded already if it can be. */
+static void
+dbtestc_opnd(Test_expr *e, int i, char *wp, Test_op op, Area *ap)
+{
+	e->opnd[i] = wp;
+	if (op == TO_STEQL || op == TO_STNEQ) {
+		/* a pattern: a literal one needs no gmatch_() */
+		if ((e->plain[i] = wdplain(wp, true, ap)) != NULL)
+			e->literal = true;
+		else
+			e->plain[i] = wdpattern(wp, ap);
+	} else
+		e->plain[i] = wdplain(wp, false, ap);
+}
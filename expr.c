@@ -138,6 +138,8 @@ enum error_type {
 static void	   evalerr(Expr_state *, enum error_type, const char *)
 		    __attribute__((__noreturn__));
 static struct tbl *evalexpr(Expr_state *, enum prec);
+static int64_t	   binop(enum token, int64_t, int64_t);
+static int64_t	   shared_asn(Expr_state *, enum token, struct tbl *, int64_t);
 static void	   token(Expr_state *);
 static struct tbl *do_ppmm(Expr_state *, enum token, struct tbl *, bool);
 static void	   assign_check(Expr_state *, enum token, struct tbl *);
@@ -155,6 +157,7 @@ evaluate(const char *expr, int64_t *rval, int error_ok, bool arith)
 
 	v.flag = DEFINED|INTEGER;
 	v.type = 0;
+	v.areap = ATEMP;
 	ret = v_evaluate(&v, expr, error_ok, arith);
 	*rval = v.val.i;
 	return ret;
@@ -232,7 +235,7 @@ evalerr(Expr_state *es, enum error_type type, const char *str)
 	case ET_UNEXPECTED:
 		switch (es->tok) {
 		case VAR:
-			s = es->val->name;
+			s = VARNAME(es->val);
 			break;
 		case LIT:
 			s = str_val(es->val);
@@ -341,70 +344,6 @@ evalexpr(Expr_state *es, enum prec prec)
 				evalerr(es, ET_STR, "zero divisor");
 		}
 		switch ((int) op) {
-		case O_TIMES:
-		case O_TIMESASN:
-			res = vl->val.i * vr->val.i;
-			break;
-		case O_DIV:
-		case O_DIVASN:
-			if (vl->val.i == LONG_MIN && vr->val.i == -1)
-				res = LONG_MIN;
-			else
-				res = vl->val.i / vr->val.i;
-			break;
-		case O_MOD:
-		case O_MODASN:
-			if (vl->val.i == LONG_MIN && vr->val.i == -1)
-				res = 0;
-			else
-				res = vl->val.i % vr->val.i;
-			break;
-		case O_PLUS:
-		case O_PLUSASN:
-			res = vl->val.i + vr->val.i;
-			break;
-		case O_MINUS:
-		case O_MINUSASN:
-			res = vl->val.i - vr->val.i;
-			break;
-		case O_LSHIFT:
-		case O_LSHIFTASN:
-			res = vl->val.i << vr->val.i;
-			break;
-		case O_RSHIFT:
-		case O_RSHIFTASN:
-			res = vl->val.i >> vr->val.i;
-			break;
-		case O_LT:
-			res = vl->val.i < vr->val.i;
-			break;
-		case O_LE:
-			res = vl->val.i <= vr->val.i;
-			break;
-		case O_GT:
-			res = vl->val.i > vr->val.i;
-			break;
-		case O_GE:
-			res = vl->val.i >= vr->val.i;
-			break;
-		case O_EQ:
-			res = vl->val.i == vr->val.i;
-			break;
-		case O_NE:
-			res = vl->val.i != vr->val.i;
-			break;
-		case O_BAND:
-		case O_BANDASN:
-			res = vl->val.i & vr->val.i;
-			break;
-		case O_BXOR:
-		case O_BXORASN:
-			res = vl->val.i ^ vr->val.i;
-			break;
-		case O_BOR:
-		case O_BORASN:
-			res = vl->val.i | vr->val.i;
-			break;
 		case O_LAND:
 			if (!vl->val.i)
 				es->noassign++;
@@ -447,13 +386,21 @@ evalexpr(Expr_state *es, enum prec prec)
 		case O_COMMA:
 			res = vr->val.i;
 			break;
+		default:
+			res = binop(op, vl->val.i, vr->val.i);
+			break;
 		}
 		if (IS_ASSIGNOP(op)) {
-			vr->val.i = res;
-			if (vasn->flag & INTEGER)
-				setint_v(vasn, vr, es->arith);
-			else
-				setint(vasn, res);
+			if ((vasn->flag & SHARED) && op != O_ASN)
+				/* vl may be stale by now, redo it atomically */
+				vr->val.i = shared_asn(es, op, vasn, vr->val.i);
+			else {
+				vr->val.i = res;
+				if (vasn->flag & INTEGER)
+					setint_v(vasn, vr, es->arith);
+				else
+					setint(vasn, res);
+			}
 			vl = vr;
 		} else if (op != O_TERN)
 			vl->val.i = res;
@@ -529,6 +476,77 @@ token(Expr_state *es)
 	es->tokp = cp;
 }
 
+/* the value of binary (or assignment) operator op, for the arithmetic ones */
+static int64_t
+binop(enum token op, int64_t l, int64_t r)
+{
+	switch ((int) op) {
+	case O_TIMES:
+	case O_TIMESASN:
+		return l * r;
+	case O_DIV:
+	case O_DIVASN:
+		if (l == LONG_MIN && r == -1)
+			return LONG_MIN;
+		return l / r;
+	case O_MOD:
+	case O_MODASN:
+		if (l == LONG_MIN && r == -1)
+			return 0;
+		return l % r;
+	case O_PLUS:
+	case O_PLUSASN:
+		return l + r;
+	case O_MINUS:
+	case O_MINUSASN:
+		return l - r;
+	case O_LSHIFT:
+	case O_LSHIFTASN:
+		return l << r;
+	case O_RSHIFT:
+	case O_RSHIFTASN:
+		return l >> r;
+	case O_LT:
+		return l < r;
+	case O_LE:
+		return l <= r;
+	case O_GT:
+		return l > r;
+	case O_GE:
+		return l >= r;
+	case O_EQ:
+		return l == r;
+	case O_NE:
+		return l != r;
+	case O_BAND:
+	case O_BANDASN:
+		return l & r;
+	case O_BXOR:
+	case O_BXORASN:
+		return l ^ r;
+	case O_BOR:
+	case O_BORASN:
+		return l | r;
+	}
+	return 0;
+}
+
+/* Apply assignment operator op with right hand side r to shared integer
+ * vasn (typeset -S), which other processes may change at the same time.
+ */
+static int64_t
+shared_asn(Expr_state *es, enum token op, struct tbl *vasn, int64_t r)
+{
+	int64_t old, new;
+
+	do {
+		if (getint(vasn, &old, es->arith) == -1)
+			old = 0;
+		new = binop(op, old, r);
+	} while (!setint_cas(vasn, old, new));
+	return new;
+}
+
 /* Do a ++ or -- operation */
 static struct tbl *
 do_ppmm(Expr_state *es, enum token op, struct tbl *vasn, bool is_prefix)
@@ -539,11 +557,17 @@ do_ppmm(Expr_state *es, enum token op, struct tbl *vasn, bool is_prefix)
 	assign_check(es, op, vasn);
 
 	vl = intvar(es, vasn);
-	oval = op == O_PLUSPLUS ? vl->val.i++ : vl->val.i--;
-	if (vasn->flag & INTEGER)
-		setint_v(vasn, vl, es->arith);
-	else
-		setint(vasn, vl->val.i);
+	if (vasn->flag & SHARED) {
+		vl->val.i = shared_asn(es,
+		    op == O_PLUSPLUS ? O_PLUSASN : O_MINUSASN, vasn, 1);
+		oval = op == O_PLUSPLUS ? vl->val.i - 1 : vl->val.i + 1;
+	} else {
+		oval = op == O_PLUSPLUS ? vl->val.i++ : vl->val.i--;
+		if (vasn->flag & INTEGER)
+			setint_v(vasn, vl, es->arith);
+		else
+			setint(vasn, vl->val.i);
+	}
 	if (!is_prefix)		/* undo the inc/dec */
 		vl->val.i = oval;
 
@@ -554,7 +578,7 @@ static void
 assign_check(Expr_state *es, enum token op, struct tbl *vasn)
 {
 	if (es->tok == END || vasn == NULL ||
-	    (vasn->name[0] == '\0' && !(vasn->flag & EXPRLVALUE)))
+	    (vasn->name[0] == '\0' && !(vasn->flag & (EXPRLVALUE|ARRAY))))
 		evalerr(es, ET_LVALUE, opinfo[(int) op].name);
 	else if (vasn->flag & RDONLY)
 		evalerr(es, ET_RDONLY, opinfo[(int) op].name);
@@ -569,6 +593,7 @@ tempvar(void)
 	vp->flag = ISSET|INTEGER;
 	vp->type = 0;
 	vp->areap = ATEMP;
+	vp->sval = NULL;
 	vp->val.i = 0;
 	vp->name[0] = '\0';
 	return vp;
@@ -580,15 +605,17 @@ intvar(Expr_state *es, struct tbl *vp)
 {
 	struct tbl *vq;
 
-	/* try to avoid replacing a temp var with another temp var */
+	/* try to avoid replacing a temp var with another temp var (array
+	 * elements have no name either)
+	 */
 	if (vp->name[0] == '\0' &&
-	    (vp->flag & (ISSET|INTEGER|EXPRLVALUE)) == (ISSET|INTEGER))
+	    (vp->flag & (ISSET|INTEGER|EXPRLVALUE|ARRAY)) == (ISSET|INTEGER))
 		return vp;
 
 	vq = tempvar();
 	if (setint_v(vq, vp, es->arith) == NULL) {
 		if (vp->flag & EXPRINEVAL)
-			evalerr(es, ET_RECURSIVE, vp->name);
+			evalerr(es, ET_RECURSIVE, VARNAME(vp));
 		es->evaling = vp;
 		vp->flag |= EXPRINEVAL;
 		disable_subst++;
@@ -84,6 +84,7 @@ static char	*get_brace_var(XString *, char *);
 static int	arraysub(char **);
 static const char *ungetsc(int);
 static void	gethere(void);
+static void	litword(char *);
 static Lex_state *push_state_(State_info *, Lex_state *);
 static Lex_state *pop_state_(State_info *, Lex_state *);
 static char	*special_prompt_expand(char *);
@@ -382,10 +383,11 @@ yylex(int cf)
 						*wp++ = CHAR, *wp++ = c;
 						c = getsc();
 					}
-					/* If this is a trim operation,
-					 * treat (,|,) specially in STBRACE.
+					/* If this is a trim or replace
+					 * operation, treat (,|,) specially
+					 * in STBRACE.
 					 */
-					if (c == '#' || c == '%') {
+					if (c == '#' || c == '%' || c == '/') {
 						ungetsc(c);
 						PUSH_STATE(STBRACE);
 					} else {
@@ -628,6 +630,8 @@ yylex(int cf)
 			break;
 
 		case SWORD:	/* ONEWORD */
+			if (cf & UNQUOTE)
+				goto Sbase2;
 			goto Subst;
 
 		case SLETPAREN:	/* LETEXPR: (( ... )) */
@@ -810,8 +814,10 @@ Done:
 
 	*wp++ = EOS;		/* terminate word */
 	yylval.cp = Xclose(ws, wp);
-	if (state == SWORD || state == SLETPAREN)	/* ONEWORD? */
+	if (state == SWORD || state == SLETPAREN) {	/* ONEWORD? */
+		litword(yylval.cp);
 		return LWORD;
+	}
 	ungetsc(c);		/* unget terminator */
 
 	/* copy word to unprefixed string ident */
@@ -837,8 +843,10 @@ Done:
 			Source *s;
 
 			for (s = source; s->type == SALIAS; s = s->next)
-				if (s->u.tblp == p)
+				if (s->u.tblp == p) {
+					litword(yylval.cp);
 					return LWORD;
+				}
 			/* push alias expansion */
 			s = pushs(SALIAS, source->areap);
 			s->start = s->str = p->val.s;
@@ -850,9 +858,67 @@ Done:
 		}
 	}
 
+	litword(yylval.cp);
 	return LWORD;
 }
 
+#define CHARSOK(c)	(letnum(c) || (c) == '.')
+
+/*
+ * Turn runs of unquoted plain characters of word wp into CHARS runs (in
+ * place), so expand() can copy them at once and stored trees are smaller.
+ * The characters chosen mean nothing to expand() or tilde expansion, and
+ * none of them can start a ${x:-y} operator.
+ */
+static void
+litword(char *wp)
+{
+	char *dp = wp;
+	int c, n;
+
+	while (1)
+		switch (*wp) {
+		case EOS:
+			*dp = EOS;
+			return;
+		case CHAR:
+			for (n = 0; n < 255 && wp[2 * n] == CHAR &&
+			    CHARSOK(wp[2 * n + 1]); n++)
+				;
+			if (n < 2) {
+				*dp++ = *wp++;
+				*dp++ = *wp++;
+				break;
+			}
+			/* dp may be wp: the first character goes first */
+			c = wp[1];
+			*dp++ = CHARS;
+			*dp++ = n;
+			*dp++ = c;
+			for (wp += 2; --n > 0; wp += 2)
+				*dp++ = wp[1];
+			break;
+		case QCHAR:
+		case CSUBST:
+		case OPAT:
+			*dp++ = *wp++;
+			*dp++ = *wp++;
+			break;
+		case OSUBST:
+			*dp++ = *wp++;
+			/* FALLTHROUGH */
+		case COMSUB:
+		case EXPRSUB:
+			*dp++ = *wp++;
+			while ((*dp++ = *wp++) != '\0')
+				;
+			break;
+		default:
+			*dp++ = *wp++;
+			break;
+		}
+}
+
 static void
 gethere(void)
 {
@@ -1494,7 +1560,7 @@ static char *
 get_brace_var(XString *wsp, char *wp)
 {
 	enum parse_state {
-			   PS_INITIAL, PS_SAW_HASH, PS_IDENT,
+			   PS_INITIAL, PS_SAW_HASH, PS_SAW_BANG, PS_IDENT,
 			   PS_NUMBER, PS_VAR1, PS_END
 			 }
 		state;
@@ -1510,6 +1576,10 @@ get_brace_var(XString *wsp, char *wp)
 				state = PS_SAW_HASH;
 				break;
 			}
+			if (c == '!') {
+				state = PS_SAW_BANG;
+				break;
+			}
 			/* FALLTHROUGH */
 		case PS_SAW_HASH:
 			if (letter(c))
@@ -1521,6 +1591,10 @@ get_brace_var(XString *wsp, char *wp)
 			else
 				state = PS_END;
 			break;
+		case PS_SAW_BANG:
+			/* ${!name[@]}, else ${!...} is $! */
+			state = letter(c) ? PS_IDENT : PS_END;
+			break;
 		case PS_IDENT:
 			if (!letnum(c)) {
 				state = PS_END;
@@ -97,6 +97,7 @@ typedef union {
 #define HEREDELIM BIT(9)	/* parsing <<,<<- delimiter */
 #define HEREDOC BIT(10)		/* parsing heredoc */
 #define UNESCAPE BIT(11)	/* remove backslashes */
+#define UNQUOTE	BIT(12)		/* ONEWORD: quotes as in a word */
 
 #define	HERES	10		/* max << in line */
 
@@ -273,10 +273,9 @@ main(int argc, char *argv[])
 	Flag(FVITABCOMPLETE) = 1;
 #endif /* VI */
 
-	/* import environment */
+	/* import environment (mostly on demand, see initenv()) */
 	if (environ != NULL)
-		for (wp = environ; *wp != NULL; wp++)
-			typeset(*wp, IMPORT|EXPORT, 0, 0, 0);
+		initenv(environ);
 
 	kshpid = procpid = getpid();
 	typeset(initifs, 0, 0, 0, 0);	/* for security */
@@ -716,7 +715,7 @@ newenv(int type)
 	ep = alloc(sizeof(*ep), ATEMP);
 	ep->type = type;
 	ep->flags = 0;
-	ainit(&ep->area);
+	ainit_temp(&ep->area);
 	ep->loc = genv->loc;
 	ep->savefd = NULL;
 	ep->oenv = genv;
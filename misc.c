@@ -448,7 +448,7 @@ parse_args(char **argv,
 		    xstrcmp);
 	}
 	if (arrayset) {
-		set_array(array, arrayset, argv + go.optind);
+		set_array(array, arrayset, false, argv + go.optind);
 		for (; argv[go.optind]; go.optind++)
 			;
 	}
@@ -485,6 +485,90 @@ bi_getn(const char *as, int *ai)
 
 /* -------- gmatch.c -------- */
 
+/*
+ * Patterns are compiled once into a program for a Thompson style NFA
+ * (see gcompile()) which grun() runs over the string in a single pass,
+ * so a match takes time linear in the length of the string.  A literal,
+ * possibly with a leading and/or trailing *, is matched with memcmp() or
+ * memmem() instead.  Compiled patterns are kept in a small cache keyed by
+ * the (MAGIC encoded) pattern.  The backtracking do_gmatch() remains for
+ * what the compiler does not handle: !(...) and malformed brackets.
+ */
+
+enum gop {
+	G_CHAR,		/* arg: the character */
+	G_ANY,		/* ? */
+	G_STAR,		/* *: any character, stays put */
+	G_SET,		/* arg: index in sets */
+	G_SPLIT,	/* continue at x and y */
+	G_JMP,		/* continue at x */
+	G_MATCH
+};
+
+struct ginst {
+	int	op;
+	int	arg;
+	int	x, y;
+};
+
+/* how a struct gprog matches */
+#define GK_EXACT	0	/* lit */
+#define GK_PREFIX	1	/* lit* */
+#define GK_SUFFIX	2	/* *lit */
+#define GK_INFIX	3	/* *lit* */
+#define GK_PROG		4	/* run prog */
+#define GK_BACKTRACK	5	/* use do_gmatch() */
+
+/* how grun() matches */
+#define GR_ALL		0	/* all of the string */
+#define GR_SHORT	1	/* shortest prefix (suffix for rprog) */
+#define GR_LONG		2	/* longest prefix (suffix for rprog) */
+
+struct gprog {
+	char	*pat;		/* the pattern, cache key */
+	int	 kind;		/* GK_* */
+	bool	 glob;		/* has_globbing(pat) */
+	char	*lit;		/* GK_EXACT..GK_INFIX: the literal */
+	size_t	 litlen;
+	struct ginst *prog;
+	struct ginst *rprog;	/* prog for the mirror image of pat */
+	int	 ninst;
+	unsigned char (*sets)[32];	/* bitmaps of [...] */
+	int	*clist, *nlist;	/* scratch for grun() */
+	int	*stack;
+	unsigned int *mark, gen;
+	bool	 final;		/* the list being made has G_MATCH */
+};
+
+struct gcomp {
+	struct ginst *prog;
+	int	 n, max;
+	unsigned char (*sets)[32];
+	int	 nsets;
+	bool	 again;		/* sets were made by an earlier pass */
+};
+
+#define GCACHESZ	64	/* compiled patterns kept, power of 2 */
+
+static struct gprog *gcache[GCACHESZ];
+
+static struct gprog *gget(const char *);
+static const char *gfirst(struct gprog *, const char *, size_t);
+static const char *glast(struct gprog *, const char *, size_t);
+static struct gprog *gcompile(const char *);
+static int	gclassify(struct gprog *, const unsigned char *,
+		    const unsigned char *);
+static int	gemit(struct gcomp *, const unsigned char *,
+		    const unsigned char *, bool);
+static const unsigned char *gatom(struct gcomp *, const unsigned char *,
+		    const unsigned char *, bool);
+static int	ginst(struct gcomp *, int, int);
+static const unsigned char *gset(struct gcomp *, const unsigned char *);
+static int	grun(struct gprog *, const struct ginst *,
+		    const unsigned char *, const unsigned char *, int);
+static void	gnewlist(struct gprog *);
+static int	gadd(struct gprog *, const struct ginst *, int *, int, int);
+
 /*
  * int gmatch(string, pattern)
  * char *string, *pattern;
@@ -496,25 +580,595 @@ bi_getn(const char *as, int *ai)
 int
 gmatch_(const char *s, const char *p, int isfile)
 {
-	const char *se, *pe;
+	struct gprog *gp;
+	size_t slen;
 
 	if (s == NULL || p == NULL)
 		return 0;
-	se = s + strlen(s);
-	pe = p + strlen(p);
+	gp = gget(p);
+	slen = strlen(s);
 	/* isfile is false iff no syntax check has been done on
 	 * the pattern.  If check fails, just to a strcmp().
 	 */
-	if (!isfile && !has_globbing(p, pe)) {
-		size_t len = pe - p + 1;
-		char tbuf[64];
-		char *t = len <= sizeof(tbuf) ? tbuf :
-		    alloc(len, ATEMP);
-		debunk(t, p, len);
-		return !strcmp(t, s);
+	switch (isfile && !gp->glob ? GK_BACKTRACK : gp->kind) {
+	case GK_EXACT:
+		return slen == gp->litlen && !memcmp(s, gp->lit, slen);
+	case GK_PREFIX:
+		return slen >= gp->litlen && !memcmp(s, gp->lit, gp->litlen);
+	case GK_SUFFIX:
+		return slen >= gp->litlen &&
+		    !memcmp(s + slen - gp->litlen, gp->lit, gp->litlen);
+	case GK_INFIX:
+		return memmem(s, slen, gp->lit, gp->litlen) != NULL;
+	case GK_PROG:
+		return grun(gp, gp->prog, (const unsigned char *) s,
+		    (const unsigned char *) s + slen, GR_ALL) >= 0;
+	}
+	return do_gmatch((const unsigned char *) s,
+	    (const unsigned char *) s + slen,
+	    (const unsigned char *) p, (const unsigned char *) p + strlen(p));
+}
+
+/*
+ * Find the shortest (longest if longest) prefix (suffix if suffix) of s
+ * that matches pattern p, in one pass over s.  Returns its length, or
+ * -1 if there is none.
+ */
+int
+gmatch_trim(const char *s, const char *p, bool suffix, bool longest)
+{
+	struct gprog *gp;
+	const char *q, *pe;
+	int slen, n;
+
+	gp = gget(p);
+	slen = strlen(s);
+	switch (gp->kind) {
+	case GK_EXACT:
+		if ((size_t)slen < gp->litlen ||
+		    memcmp(suffix ? s + slen - gp->litlen : s, gp->lit,
+		    gp->litlen))
+			return -1;
+		return gp->litlen;
+	case GK_PREFIX:
+		if (!suffix)
+			return (size_t)slen < gp->litlen ||
+			    memcmp(s, gp->lit, gp->litlen) ? -1 :
+			    longest ? slen : (int)gp->litlen;
+		q = longest ? gfirst(gp, s, slen) : glast(gp, s, slen);
+		return q == NULL ? -1 : s + slen - q;
+	case GK_SUFFIX:
+		if (suffix)
+			return (size_t)slen < gp->litlen ||
+			    memcmp(s + slen - gp->litlen, gp->lit,
+			    gp->litlen) ? -1 :
+			    longest ? slen : (int)gp->litlen;
+		q = longest ? glast(gp, s, slen) : gfirst(gp, s, slen);
+		return q == NULL ? -1 : q - s + (int)gp->litlen;
+	case GK_INFIX:
+		q = suffix ? glast(gp, s, slen) : gfirst(gp, s, slen);
+		if (q == NULL)
+			return -1;
+		if (longest)
+			return slen;
+		return suffix ? s + slen - q : q - s + (int)gp->litlen;
+	case GK_PROG:
+		return grun(gp, suffix ? gp->rprog : gp->prog,
+		    (const unsigned char *) s,
+		    (const unsigned char *) s + slen,
+		    longest ? GR_LONG : GR_SHORT);
+	}
+	/* try every split */
+	pe = p + strlen(p);
+	for (n = longest ? slen : 0; n >= 0 && n <= slen;
+	    n += longest ? -1 : 1)
+		if (suffix ? do_gmatch((const unsigned char *) s + slen - n,
+		    (const unsigned char *) s + slen,
+		    (const unsigned char *) p, (const unsigned char *) pe) :
+		    do_gmatch((const unsigned char *) s,
+		    (const unsigned char *) s + n,
+		    (const unsigned char *) p, (const unsigned char *) pe))
+			return n;
+	return -1;
+}
+
+/*
+ * Find the leftmost longest non-empty match of pattern p in s (of length
+ * slen).  Returns its offset and sets *lenp, or returns -1.
+ */
+int
+gmatch_search(const char *s, int slen, const char *p, int *lenp)
+{
+	struct gprog *gp;
+	const char *q, *pe;
+	int i, n;
+
+	gp = gget(p);
+	switch (gp->kind) {
+	case GK_EXACT:
+		if (gp->litlen == 0 || (q = gfirst(gp, s, slen)) == NULL)
+			return -1;
+		*lenp = gp->litlen;
+		return q - s;
+	case GK_PREFIX:
+		if ((q = gfirst(gp, s, slen)) == NULL || q == s + slen)
+			return -1;
+		*lenp = s + slen - q;
+		return q - s;
+	case GK_SUFFIX:
+		if ((q = glast(gp, s, slen)) == NULL ||
+		    q + gp->litlen == s)
+			return -1;
+		*lenp = q - s + gp->litlen;
+		return 0;
+	case GK_INFIX:
+		if (gfirst(gp, s, slen) == NULL)
+			return -1;
+		*lenp = slen;
+		return 0;
+	}
+	pe = p + strlen(p);
+	for (i = 0; i < slen; i++) {
+		if (gp->kind == GK_PROG)
+			n = grun(gp, gp->prog, (const unsigned char *) s + i,
+			    (const unsigned char *) s + slen, GR_LONG);
+		else
+			for (n = slen - i; n > 0; n--)
+				if (do_gmatch((const unsigned char *) s + i,
+				    (const unsigned char *) s + i + n,
+				    (const unsigned char *) p,
+				    (const unsigned char *) pe))
+					break;
+		if (n > 0) {
+			*lenp = n;
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* first occurrence of the literal in s */
+static const char *
+gfirst(struct gprog *gp, const char *s, size_t slen)
+{
+	if (gp->litlen == 1)
+		return memchr(s, gp->lit[0], slen);
+	return memmem(s, slen, gp->lit, gp->litlen);
+}
+
+/* last occurrence of the literal in s */
+static const char *
+glast(struct gprog *gp, const char *s, size_t slen)
+{
+	const char *q;
+
+	if (slen < gp->litlen)
+		return NULL;
+	for (q = s + slen - gp->litlen; ; q--) {
+		if (*q == gp->lit[0] && !memcmp(q, gp->lit, gp->litlen))
+			return q;
+		if (q == s)
+			return NULL;
+	}
+}
+
+/* look up the compiled form of pattern p, compiling it if need be */
+static struct gprog *
+gget(const char *p)
+{
+	struct gprog **gpp = &gcache[hash(p) & (GCACHESZ - 1)];
+
+	if (*gpp != NULL) {
+		if (!strcmp((*gpp)->pat, p))
+			return *gpp;
+		afree(*gpp, APERM);
+		*gpp = NULL;
+	}
+	return *gpp = gcompile(p);
+}
+
+static struct gprog *
+gcompile(const char *p)
+{
+	struct gprog *gp;
+	struct gcomp gc;
+	const char *q;
+	size_t len, size;
+	int ninst, nsets = 0;
+	char *cp;
+
+	len = strlen(p);
+	for (q = p; (q = strchr(q, MAGIC)) != NULL && q[1] != '\0'; q += 2)
+		if (q[1] == '[')
+			nsets++;
+	/* no construct takes more instructions than pattern characters */
+	ninst = len + 1;
+
+	size = sizeof(*gp) + ninst * (2 * sizeof(struct ginst) +
+	    4 * sizeof(int)) + nsets * sizeof(*gp->sets) + 2 * (len + 1);
+	gp = alloc(size, APERM);
+	gp->prog = (struct ginst *) (gp + 1);
+	gp->rprog = gp->prog + ninst;
+	gp->clist = (int *) (gp->rprog + ninst);
+	gp->nlist = gp->clist + ninst;
+	gp->stack = gp->nlist + ninst;
+	gp->mark = (unsigned int *) (gp->stack + ninst);
+	gp->sets = (unsigned char (*)[32]) (gp->mark + ninst);
+	cp = (char *) (gp->sets + nsets);
+	gp->pat = memcpy(cp, p, len + 1);
+	gp->lit = cp + len + 1;
+	gp->ninst = 0;
+	gp->gen = 0;
+	memset(gp->mark, 0, ninst * sizeof(int));
+
+	if (!(gp->glob = has_globbing(p, p + len))) {
+		debunk(gp->lit, p, len + 1);
+		gp->litlen = strlen(gp->lit);
+		gp->kind = GK_EXACT;
+		return gp;
+	}
+	gp->kind = gclassify(gp, (const unsigned char *) p,
+	    (const unsigned char *) p + len);
+	if (gp->kind != GK_PROG)
+		return gp;
+
+	gc.prog = gp->prog;
+	gc.n = 0;
+	gc.max = ninst;
+	gc.sets = gp->sets;
+	gc.nsets = 0;
+	gc.again = false;
+	if (gemit(&gc, (const unsigned char *) p,
+	    (const unsigned char *) p + len, false) &&
+	    ginst(&gc, G_MATCH, 0) >= 0) {
+		gp->ninst = gc.n;
+		gc.prog = gp->rprog;
+		gc.n = 0;
+		gc.nsets = 0;
+		gc.again = true;
+		if (gemit(&gc, (const unsigned char *) p,
+		    (const unsigned char *) p + len, true) &&
+		    ginst(&gc, G_MATCH, 0) >= 0)
+			return gp;
+	}
+	gp->kind = GK_BACKTRACK;
+	return gp;
+}
+
+/* is the MAGIC-c sequence something other than a quoted character? */
+#define GSPECIAL(c)	((c) == '*' || (c) == '?' || (c) == '[' || \
+			    (c) == '\0' || ((c) & 0x80))
+
+/* Sort out literals with leading and trailing *s; the literal is left in
+ * gp->lit.
+ */
+static int
+gclassify(struct gprog *gp, const unsigned char *p, const unsigned char *pe)
+{
+	bool lead = false, trail = false;
+	char *lp = gp->lit;
+
+	for (; p < pe && ISMAGIC(p[0]) && p[1] == '*'; p += 2)
+		lead = true;
+	while (p < pe) {
+		if (!ISMAGIC(p[0]))
+			*lp++ = *p++;
+		else if (!GSPECIAL(p[1])) {
+			*lp++ = p[1];
+			p += 2;
+		} else
+			break;
+	}
+	for (; p < pe && ISMAGIC(p[0]) && p[1] == '*'; p += 2)
+		trail = true;
+	if (p != pe)
+		return GK_PROG;
+	*lp = '\0';
+	gp->litlen = lp - gp->lit;
+	if (lead)
+		return trail ? GK_INFIX : GK_SUFFIX;
+	return trail ? GK_PREFIX : GK_EXACT;
+}
+
+/* Emit the code for pattern p..pe, or for its mirror image if rev (used
+ * to match suffixes); returns 0 if the pattern is one the compiler does
+ * not handle.
+ */
+static int
+gemit(struct gcomp *gc, const unsigned char *p, const unsigned char *pe,
+    bool rev)
+{
+	struct ginst *tmp;
+	int *item, nitem = 0, start = gc->n, to, i, j, d;
+	int ok = 1;
+
+	/* the items are emitted in order, then their code is reversed */
+	item = rev ? areallocarray(NULL, pe - p + 1, sizeof(int), ATEMP) :
+	    NULL;
+	while (p < pe) {
+		if (rev)
+			item[nitem++] = gc->n;
+		if ((p = gatom(gc, p, pe, rev)) == NULL) {
+			ok = 0;
+			break;
+		}
+	}
+	if (ok && nitem > 1) {
+		item[nitem] = gc->n;
+		tmp = areallocarray(NULL, gc->n - start, sizeof(*tmp), ATEMP);
+		memcpy(tmp, gc->prog + start, (gc->n - start) * sizeof(*tmp));
+		/* jumps stay within an item, or go just past it */
+		for (to = start, i = nitem - 1; i >= 0; i--) {
+			d = to - item[i];
+			for (j = item[i]; j < item[i + 1]; j++, to++) {
+				gc->prog[to] = tmp[j - start];
+				if (gc->prog[to].op == G_SPLIT)
+					gc->prog[to].y += d;
+				if (gc->prog[to].op == G_SPLIT ||
+				    gc->prog[to].op == G_JMP)
+					gc->prog[to].x += d;
+			}
+		}
+		afree(tmp, ATEMP);
+	}
+	afree(item, ATEMP);
+	return ok;
+}
+
+/* Emit the code for the pattern item at p; returns the end of the item,
+ * or NULL.
+ */
+static const unsigned char *
+gatom(struct gcomp *gc, const unsigned char *p, const unsigned char *pe,
+    bool rev)
+{
+	const unsigned char *prest, *psub, *pnext;
+	int c, l, i, j;
+
+	c = *p++;
+	if (!ISMAGIC(c))
+		return ginst(gc, G_CHAR, c) < 0 ? NULL : p;
+	if (p >= pe)
+		return NULL;
+	switch ((c = *p++)) {
+	case '?':
+		if (ginst(gc, G_ANY, 0) < 0)
+			return NULL;
+		return p;
+
+	case '*':
+		while (p < pe && ISMAGIC(p[0]) && p[1] == '*')
+			p += 2;
+		if (ginst(gc, G_STAR, 0) < 0)
+			return NULL;
+		return p;
+
+	case '[':
+		return gset(gc, p);
+
+	case 0x80|'*':
+	case 0x80|'+':
+	case 0x80|'?':
+	case 0x80|'@':
+	case 0x80|' ':
+		break;
+
+	case 0x80|'!':
+	case 0x80:
+	case '\0':
+		return NULL;
+
+	default:
+		return ginst(gc, G_CHAR, c) < 0 ? NULL : p;
+	}
+
+	if (!(prest = pat_scan(p, pe, 0)))
+		return NULL;
+	/* *(..) and ?(..) may be skipped, *(..) and +(..) loop back to l */
+	l = gc->n;
+	if ((c == (0x80|'*') || c == (0x80|'?')) &&
+	    ginst(gc, G_SPLIT, 0) < 0)
+		return NULL;
+	/* alternatives: jumps to the end are chained in x */
+	for (psub = p, j = -1; ; psub = pnext) {
+		pnext = pat_scan(psub, prest, 1);
+		if (pnext == prest) {
+			if (!gemit(gc, psub, pnext - 2, rev))
+				return NULL;
+			break;
+		}
+		if ((i = ginst(gc, G_SPLIT, 0)) < 0)
+			return NULL;
+		gc->prog[i].x = i + 1;
+		if (!gemit(gc, psub, pnext - 2, rev) ||
+		    ginst(gc, G_JMP, 0) < 0)
+			return NULL;
+		gc->prog[gc->n - 1].x = j;
+		j = gc->n - 1;
+		gc->prog[i].y = gc->n;
+	}
+	for (; j >= 0; j = i) {
+		i = gc->prog[j].x;
+		gc->prog[j].x = gc->n;
+	}
+	if (c == (0x80|'*')) {
+		if ((i = ginst(gc, G_JMP, 0)) < 0)
+			return NULL;
+		gc->prog[i].x = l;
+	} else if (c == (0x80|'+')) {
+		if ((i = ginst(gc, G_SPLIT, 0)) < 0)
+			return NULL;
+		gc->prog[i].x = l;
+		gc->prog[i].y = i + 1;
+	}
+	if (c == (0x80|'*') || c == (0x80|'?')) {
+		gc->prog[l].x = l + 1;
+		gc->prog[l].y = gc->n;
+	}
+	return prest;
+}
+
+static int
+ginst(struct gcomp *gc, int op, int arg)
+{
+	struct ginst *ip;
+
+	if (gc->n >= gc->max)
+		return -1;
+	ip = &gc->prog[gc->n];
+	ip->op = op;
+	ip->arg = arg;
+	ip->x = ip->y = 0;
+	return gc->n++;
+}
+
+/* Compile the [...] starting at p (just past the [) into a bitmap by
+ * asking cclass() about every character.
+ */
+static const unsigned char *
+gset(struct gcomp *gc, const unsigned char *p)
+{
+	const unsigned char *q, *end = NULL;
+	unsigned char *set = gc->sets[gc->nsets];
+	int c;
+
+	if (gc->again) {
+		/* the set is known, cclass() only has to find the end */
+		for (c = 1; c <= UCHAR_MAX; c++)
+			if (set[c >> 3] & (1 << (c & 7))) {
+				end = cclass(p, c);
+				break;
+			}
+		goto done;
+	}
+	memset(set, 0, sizeof(*gc->sets));
+	for (c = 1; c <= UCHAR_MAX; c++) {
+		if ((q = cclass(p, c)) == NULL)
+			continue;
+		/* q == p: no closing ], the [ matches itself */
+		if (q == p || (end != NULL && q != end))
+			return NULL;
+		end = q;
+		set[c >> 3] |= 1 << (c & 7);
+	}
+  done:
+	if (end == NULL || ginst(gc, G_SET, gc->nsets) < 0)
+		return NULL;
+	gc->nsets++;
+	return end;
+}
+
+/* Run prog over s..se, keeping the set of live states; rprog is run
+ * from the end of the string.  Returns the length of the match or -1.
+ */
+static int
+grun(struct gprog *gp, const struct ginst *prog, const unsigned char *s,
+    const unsigned char *se, int how)
+{
+	const struct ginst *ip;
+	int *clist = gp->clist, *nlist = gp->nlist, *t;
+	int nc, nn, i, k, len = se - s, best = -1;
+	bool rev = prog == gp->rprog;
+	int c;
+
+	gnewlist(gp);
+	nc = gadd(gp, prog, clist, 0, 0);
+	for (k = 0; ; k++) {
+		if (gp->final && how != GR_ALL) {
+			best = k;
+			if (how == GR_SHORT)
+				break;
+		}
+		if (k == len || nc == 0)
+			break;
+		c = rev ? se[-k - 1] : s[k];
+		gnewlist(gp);
+		for (nn = 0, i = 0; i < nc; i++) {
+			ip = &prog[clist[i]];
+			switch (ip->op) {
+			case G_CHAR:
+				if (c != ip->arg)
+					continue;
+				break;
+			case G_SET:
+				if (!(gp->sets[ip->arg][c >> 3] &
+				    (1 << (c & 7))))
+					continue;
+				break;
+			case G_STAR:
+				/* stays put */
+				nn = gadd(gp, prog, nlist, nn, clist[i]);
+				continue;
+			case G_ANY:
+				break;
+			default:
+				continue;
+			}
+			nn = gadd(gp, prog, nlist, nn, clist[i] + 1);
+		}
+		t = clist, clist = nlist, nlist = t;
+		nc = nn;
+	}
+	if (how == GR_ALL && k == len && gp->final)
+		best = len;
+	return best;
+}
+
+/* states are marked as added with the generation of the list */
+static void
+gnewlist(struct gprog *gp)
+{
+	if (++gp->gen == 0) {
+		memset(gp->mark, 0, gp->ninst * sizeof(int));
+		gp->gen = 1;
+	}
+	gp->final = false;
+}
+
+/* Add state pc and everything reachable from it without consuming a
+ * character to list, which holds n states.
+ */
+static int
+gadd(struct gprog *gp, const struct ginst *prog, int *list, int n, int pc)
+{
+	const struct ginst *ip;
+	int sp = 0;
+
+	if (gp->mark[pc] == gp->gen)
+		return n;
+	gp->mark[pc] = gp->gen;
+	gp->stack[sp++] = pc;
+	while (sp > 0) {
+		ip = &prog[pc = gp->stack[--sp]];
+		switch (ip->op) {
+		case G_SPLIT:
+			if (gp->mark[ip->y] != gp->gen) {
+				gp->mark[ip->y] = gp->gen;
+				gp->stack[sp++] = ip->y;
+			}
+			/* FALLTHROUGH */
+		case G_JMP:
+			if (gp->mark[ip->x] != gp->gen) {
+				gp->mark[ip->x] = gp->gen;
+				gp->stack[sp++] = ip->x;
+			}
+			break;
+		case G_STAR:
+			list[n++] = pc;
+			if (gp->mark[pc + 1] != gp->gen) {
+				gp->mark[pc + 1] = gp->gen;
+				gp->stack[sp++] = pc + 1;
+			}
+			break;
+		case G_MATCH:
+			gp->final = true;
+			/* FALLTHROUGH */
+		default:
+			list[n++] = pc;
+			break;
+		}
 	}
-	return do_gmatch((const unsigned char *) s, (const unsigned char *) se,
-	    (const unsigned char *) p, (const unsigned char *) pe);
+	return n;
 }
 
 /* Returns if p is a syntacticly correct globbing pattern, false
@@ -51,6 +51,16 @@ extern	int	disable_subst;	/* disable substitution during evaluation */
  */
 typedef struct Area {
 	struct link *freelist;	/* free list */
+	struct chunk *chunks;	/* chunks of a temporary area */
+	char	*bump;		/* next free byte in current chunk */
+	char	*limit;		/* end of current chunk */
+	void	*last;		/* last block taken from current chunk */
+	bool	chunked;	/* bump allocate small blocks (ainit_temp()) */
+	size_t	nbytes;		/* bytes in live blocks */
+	size_t	nblocks;	/* number of live blocks */
+	size_t	peak;		/* most bytes ever live at once */
+	unsigned long nalloc;	/* blocks allocated */
+	unsigned long nfree;	/* blocks freed */
 } Area;
 
 extern	Area	aperm;		/* permanent object space */
@@ -373,6 +383,7 @@ extern	int	x_cols;	/* tty columns */
 
 /* alloc.c */
 Area *	ainit(Area *);
+Area *	ainit_temp(Area *);
 void	afreeall(Area *);
 void *	alloc(size_t, Area *);
 void *	areallocarray(void *, size_t, size_t, Area *);
@@ -424,6 +435,7 @@ void	set_editmode(const char *);
 int	x_bind(const char *, const char *, int, int);
 /* eval.c */
 char *	substitute(const char *, int);
+char *	keysubstitute(const char *);
 char **	eval(char **, int);
 char *	evalstr(char *cp, int);
 char *	evalonestr(char *cp, int);
@@ -441,6 +453,8 @@ void	flushcom(int);
 char *	search(const char *, const char *, int, int *);
 int	search_access(const char *, int, int *);
 int	pr_menu(char *const *);
+struct test_expr *dbtest_compile(char **, Area *);
+void	dbtest_free(struct test_expr *, Area *);
 /* expr.c */
 int	evaluate(const char *, int64_t *, int, bool);
 int	v_evaluate(struct tbl *, const char *, volatile int, bool);
@@ -540,6 +554,8 @@ int	parse_args(char **, int, int *);
 int	getn(const char *, int *);
 int	bi_getn(const char *, int *);
 int	gmatch_(const char *, const char *, int);
+int	gmatch_trim(const char *, const char *, bool, bool);
+int	gmatch_search(const char *, int, const char *, int *);
 int	has_globbing(const char *, const char *);
 const unsigned char *pat_scan(const unsigned char *, const unsigned char *,
     int);
@@ -584,12 +600,16 @@ void	newblock(void);
 void	popblock(void);
 void	initvar(void);
 struct tbl *	global(const char *);
+struct tbl *	global_noref(const char *);
+struct tbl *	global_peek(const char *);
 struct tbl *	local(const char *, bool);
 char *	str_val(struct tbl *);
 int64_t	intval(struct tbl *);
 int	setstr(struct tbl *, const char *, int);
+void	varshare(struct tbl *);
 struct tbl *setint_v(struct tbl *, struct tbl *, bool);
 void	setint(struct tbl *, int64_t);
+bool	setint_cas(struct tbl *, int64_t, int64_t);
 int	getint(struct tbl *, int64_t *, bool);
 struct tbl *typeset(const char *, int, int, int, int);
 void	unset(struct tbl *, int);
@@ -597,9 +617,13 @@ char  * skip_varname(const char *, int);
 char	*skip_wdvarname(const char *, int);
 int	is_wdvarname(const char *, int);
 int	is_wdvarassign(const char *);
+void	initenv(char **);
+void	importenv(void);
+void	cacheenv(void);
 char **	makenv(void);
 void	change_random(void);
 int	array_ref_len(const char *);
 char *	arrayname(const char *);
-void    set_array(const char *, int, char **);
+struct tbl **	arraylist(struct tbl *);
+void    set_array(const char *, int, bool, char **);
 /* vi.c: see edit.h */
@@ -23,10 +23,12 @@ static void	musthave(int, int);
 static struct op *nested(int, int, int);
 static struct op *get_command(int);
 static struct op *dogroup(void);
+static char **	plainwords(char **, bool);
 static struct op *thenpart(void);
 static struct op *elsepart(void);
 static struct op *caselist(void);
 static struct op *casepart(int);
+static void	casewords(struct op *);
 static struct op *function_body(char *, int);
 static char **	wordlist(void);
 static struct op *block(int, struct op *, struct op *, char **);
@@ -35,6 +37,8 @@ static void	syntaxerr(const char *) __attribute__((__noreturn__));
 static void	nesting_push(struct nesting_state *, int);
 static void	nesting_pop(struct nesting_state *);
 static int	assign_command(char *);
+static int	array_assign(const char *);
+static char	*array_word(char *, char **, int);
 static int	inalias(struct source *);
 static int	dbtestp_isa(Test_env *, Test_meta);
 static const char *dbtestp_getopnd(Test_env *, Test_op, int);
@@ -193,6 +197,7 @@ get_command(int cf)
 {
 	struct op *t;
 	int c, iopn = 0, syniocf;
+	bool asn = false, arrays = false;
 	struct ioword *iop, **iops;
 	XPtrV args, vars;
 	struct nesting_state old_nesting;
@@ -225,10 +230,12 @@ get_command(int cf)
 				if (iopn >= NUFILE)
 					yyerror("too many redirections\n");
 				iops[iopn++] = synio(cf);
+				asn = false;
 				break;
 
 			case LWORD:
 				reject = false;
+				asn = false;
 				/* the iopn == 0 and XPsize(vars) == 0 are
 				 * dubious but at&t ksh acts this way
 				 */
@@ -237,13 +244,41 @@ get_command(int cf)
 				    assign_command(ident))
 					t->u.evalflags = DOVACHECK;
 				if ((XPsize(args) == 0 || Flag(FKEYWORD)) &&
-				    is_wdvarassign(yylval.cp))
+				    is_wdvarassign(yylval.cp)) {
 					XPput(vars, yylval.cp);
-				else
+					asn = XPsize(args) == 0 &&
+					    array_assign(yylval.cp);
+				} else {
+					if (arrays)
+						yyerror("array assignment"
+						    " before a command\n");
 					XPput(args, yylval.cp);
+				}
 				break;
 
 			case '(':
+				/* name=(...) and name+=(...) set or append to
+				 * an array (see array_word())
+				 */
+				if (asn) {
+					XPtrV items;
+					char **wp;
+
+					reject = false;
+					XPinit(items, 16);
+					while ((c = token(CONTIN)) == LWORD)
+						XPput(items, yylval.cp);
+					if (c != ')')
+						syntaxerr(NULL);
+					wp = (char **) vars.cur - 1;
+					*wp = array_word(*wp,
+					    (char **) XPptrv(items),
+					    XPsize(items));
+					XPfree(items);
+					asn = false;
+					arrays = true;
+					break;
+				}
 				/* Check for "> foo (echo hi)", which at&t ksh
 				 * allows (not POSIX, but not disallowed)
 				 */
@@ -343,6 +378,7 @@ get_command(int cf)
 		t->str = yylval.cp;
 		nesting_push(&old_nesting, c);
 		t->left = caselist();
+		t->ctab = casetab(t->left, ATEMP);
 		nesting_pop(&old_nesting);
 		break;
 
@@ -405,6 +441,11 @@ get_command(int cf)
 		t->args = (char **) XPclose(args);
 		XPput(vars, NULL);
 		t->vars = (char **) XPclose(vars);
+		if (t->type == TCOM) {
+			t->pargs = plainwords(t->args, true);
+			t->pvars = plainwords(t->vars, false);
+		} else
+			t->texpr = dbtest_compile(t->args, ATEMP);
 	} else {
 		XPfree(args);
 		XPfree(vars);
@@ -413,6 +454,36 @@ get_command(int cf)
 	return t;
 }
 
+/* The plain strings of words wp (see wdplain()), so execute() can skip
+ * expanding them: for arguments all or nothing, for assignments NULL
+ * where one needs expanding.
+ */
+static char **
+plainwords(char **wp, bool arg)
+{
+	char **pw;
+	int i, n, nplain = 0;
+
+	for (n = 0; wp[n] != NULL; n++)
+		;
+	if (n == 0)
+		return NULL;
+	pw = areallocarray(NULL, n + 1, sizeof(char *), ATEMP);
+	for (i = 0; i < n; i++)
+		if ((pw[i] = wdplain(wp[i], arg, ATEMP)) != NULL)
+			nplain++;
+		else if (arg)
+			break;
+	if (nplain == 0 || (arg && nplain < n)) {
+		while (--i >= 0)
+			afree(pw[i], ATEMP);
+		afree(pw, ATEMP);
+		return NULL;
+	}
+	pw[n] = NULL;
+	return pw;
+}
+
 static struct op *
 dogroup(void)
 {
@@ -519,6 +590,7 @@ casepart(int endtok)
 	XPput(ptns, NULL);
 	t->vars = (char **) XPclose(ptns);
 	musthave(')', 0);
+	casewords(t);
 
 	t->left = c_list(true);
 	/* Note: Posix requires the ;; */
@@ -527,6 +599,37 @@ casepart(int endtok)
 	return (t);
 }
 
+/* Sort the patterns of case arm t into literals and patterns that need
+ * no substitutions (see TPAT pargs and pvars), so execute() can skip
+ * expanding them.
+ */
+static void
+casewords(struct op *t)
+{
+	int i, n, nplain = 0, npat = 0;
+
+	for (n = 0; t->vars[n] != NULL; n++)
+		;
+	t->pargs = areallocarray(NULL, n + 1, sizeof(char *), ATEMP);
+	t->pvars = areallocarray(NULL, n + 1, sizeof(char *), ATEMP);
+	for (i = 0; i < n; i++) {
+		t->pvars[i] = NULL;
+		if ((t->pargs[i] = wdplain(t->vars[i], true, ATEMP)) != NULL)
+			nplain++;
+		else if ((t->pvars[i] = wdpattern(t->vars[i], ATEMP)) != NULL)
+			npat++;
+	}
+	t->pargs[n] = t->pvars[n] = NULL;
+	if (nplain == 0) {
+		afree(t->pargs, ATEMP);
+		t->pargs = NULL;
+	}
+	if (npat == 0) {
+		afree(t->pvars, ATEMP);
+		t->pvars = NULL;
+	}
+}
+
 static struct op *
 function_body(char *name,
     int ksh_func)		/* function foo { ... } vs foo() { .. } */
@@ -753,6 +856,9 @@ newtp(int type)
 	t->type = type;
 	t->u.evalflags = 0;
 	t->args = t->vars = NULL;
+	t->pargs = t->pvars = NULL;
+	t->ctab = NULL;
+	t->texpr = NULL;
 	t->ioact = NULL;
 	t->left = t->right = NULL;
 	t->str = NULL;
@@ -791,6 +897,53 @@ assign_command(char *s)
 	    (strcmp(s, "typeset") == 0);
 }
 
+/* Check if the coded word w is name= or name+= (nothing after the =) */
+static int
+array_assign(const char *w)
+{
+	const char *p = skip_wdvarname(w, false);
+
+	if (p == w)
+		return 0;
+	if (p[0] == CHAR && p[1] == '+')
+		p += 2;
+	return p[0] == CHAR && p[1] == '=' && p[2] == EOS;
+}
+
+/* Make the word for name=(item ...) from the word w (name= or name+=) and
+ * the item words: the items go between OPAT '(' and CPAT, separated by
+ * SPAT (see wdarray()).
+ */
+static char *
+array_word(char *w, char **items, int n)
+{
+	XString xs;
+	char *xp;
+	size_t len;
+	int i;
+
+	len = wdscan(w, EOS) - w - 1;
+	Xinit(xs, xp, len + 64, ATEMP);
+	memcpy(xp, w, len);
+	xp += len;
+	*xp++ = OPAT;
+	*xp++ = '(';
+	for (i = 0; i < n; i++) {
+		len = wdscan(items[i], EOS) - items[i] - 1;
+		XcheckN(xs, xp, len + 1);
+		if (i > 0)
+			*xp++ = SPAT;
+		memcpy(xp, items[i], len);
+		xp += len;
+		afree(items[i], ATEMP);
+	}
+	XcheckN(xs, xp, 2);
+	*xp++ = CPAT;
+	*xp++ = EOS;
+	afree(w, ATEMP);
+	return Xclose(xs, xp);
+}
+
 /* Check if we are in the middle of reading an alias */
 static int
 inalias(struct source *s)
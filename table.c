@@ -11,6 +11,7 @@
 #include "sh.h"
 
 #define	INIT_TBLS	8	/* initial table size (power of 2) */
+#define	TMIGRATE	8	/* slots moved per lookup while resizing */
 
 struct table taliases;	/* tracked aliases */
 struct table builtins;	/* built-in commands */
@@ -26,59 +27,212 @@ int cur_prompt;		/* PS1 or PS2 */
 int current_lineno;	/* LINENO value */
 
 static void	texpand(struct table *, int);
+static void	tmigrate(struct table *, int, int);
+static void	tinsert(struct table *, struct tbl *);
+static struct tbl **tfind(struct tbl **, int, const char *, unsigned int);
+static int	tdelete(struct tbl **, int, struct tbl *);
+static int	tsizefor(int);
+static int	tcount(struct table *);
 static int	tnamecmp(const void *, const void *);
+static int	tprobelen(struct tbl **, int, int);
+static void	tstatarray(struct tstats *, struct tbl **, int);
+static int	tblclass(size_t);
+
+/*
+ * Table entries are pooled by the space they have for the name.  Pooled
+ * entries are carved out of slabs in APERM and recycled through per-class
+ * free lists, so the tables of short lived blocks (see popblock()) don't
+ * cost a malloc per variable.  Entries with longer names are allocated on
+ * their own.
+ */
+#define	TBL_SLAB	32	/* entries per slab */
+
+static const size_t tblnamecap[] = { 8, 16, 32, 64 };
+static struct tbl *tblpool[NELEM(tblnamecap)];	/* linked via u.next */
 
 
+/*
+ * FxHash style: mix in the name a word at a time, then fold the well mixed
+ * high bits down, as only the low bits are used to index a table.
+ */
+#define HMUL		0x517cc1b727220a95ULL
+#define HROTL(h)	(((h) << 5) | ((h) >> 59))
+
 unsigned int
 hash(const char *n)
 {
-	unsigned int h = 0;
+	uint64_t h = 0, w;
+	size_t len = strlen(n);
 
-	while (*n != '\0')
-		h = 33*h + (unsigned char)(*n++);
-	return h;
+	for (; len >= sizeof(w); n += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, n, sizeof(w));
+		h = (HROTL(h) ^ w) * HMUL;
+	}
+	if (len > 0) {
+		w = 0;
+		memcpy(&w, n, len);
+		h = (HROTL(h) ^ w) * HMUL;
+	}
+	h ^= h >> 32;
+	h *= HMUL;
+	return (unsigned int)(h >> 32);
 }
 
 void
 ktinit(struct table *tp, Area *ap, int tsize)
 {
 	tp->areap = ap;
-	tp->tbls = NULL;
+	tp->tbls = tp->otbls = NULL;
 	tp->size = tp->nfree = 0;
+	tp->osize = tp->onext = tp->oleft = 0;
+	tp->nhit = tp->nmiss = 0;
 	if (tsize)
 		texpand(tp, tsize);
 }
 
+/*
+ * Resizing is incremental: the old array is kept as tp->otbls and its
+ * slots are moved over a few at a time by ktsearch() and ktenter() (see
+ * tmigrate()), so no single lookup pays for rehashing a large table.
+ * Until then names are looked up in both arrays and new ones are only
+ * entered in the new array.
+ */
 static void
 texpand(struct table *tp, int nsize)
 {
 	int i;
-	struct tbl *tblp, **p;
-	struct tbl **ntblp, **otblp = tp->tbls;
-	int osize = tp->size;
+	struct tbl **ntblp;
+
+	/* only one resize at a time */
+	tmigrate(tp, tp->oleft, 1);
 
 	ntblp = areallocarray(NULL, nsize, sizeof(struct tbl *), tp->areap);
 	for (i = 0; i < nsize; i++)
 		ntblp[i] = NULL;
+	if (tp->tbls != NULL) {
+		tp->otbls = tp->tbls;
+		tp->osize = tp->size;
+		tp->oleft = tp->size;
+		/* start right after an empty slot, see tmigrate() */
+		for (i = 0; tp->otbls[i] != NULL; i++)
+			;
+		tp->onext = (i + 1) & (tp->osize - 1);
+	}
 	tp->size = nsize;
 	tp->nfree = 7*nsize/10;	/* table can get 70% full */
 	tp->tbls = ntblp;
-	if (otblp == NULL)
-		return;
-	for (i = 0; i < osize; i++)
-		if ((tblp = otblp[i]) != NULL) {
-			if ((tblp->flag&DEFINED)) {
-				for (p = &ntblp[hash(tblp->name) &
-				    (tp->size-1)]; *p != NULL; p--)
-					if (p == ntblp) /* wrap */
-						p += tp->size;
-				*p = tblp;
-				tp->nfree--;
-			} else if (!(tblp->flag & FINUSE)) {
-				afree(tblp, tp->areap);
-			}
+}
+
+/*
+ * Move up to n slots of the old array to the new one, dropping entries
+ * that are no longer defined if purge is set.  Slots are emptied in
+ * ascending order, starting after an empty slot: as probing goes down,
+ * the probe path of an entry still in the old array never crosses a
+ * slot that has been emptied, so lookups in the old array keep working.
+ */
+static void
+tmigrate(struct table *tp, int n, int purge)
+{
+	struct tbl *p;
+
+	while (tp->otbls != NULL && n-- > 0) {
+		p = tp->otbls[tp->onext];
+		tp->otbls[tp->onext] = NULL;
+		tp->onext = (tp->onext + 1) & (tp->osize - 1);
+		if (p != NULL) {
+			if ((p->flag&DEFINED) || !purge)
+				tinsert(tp, p);
+			else if (!(p->flag & FINUSE))
+				tbfree(p);
+		}
+		if (--tp->oleft == 0) {
+			afree(tp->otbls, tp->areap);
+			tp->otbls = NULL;
+			tp->osize = 0;
+		}
+	}
+}
+
+/* put an entry known not to be there in the new array */
+static void
+tinsert(struct table *tp, struct tbl *p)
+{
+	struct tbl **pp;
+
+	for (pp = &tp->tbls[p->hval & (tp->size-1)]; *pp != NULL; pp--)
+		if (pp == tp->tbls) /* wrap */
+			pp += tp->size;
+	*pp = p;
+	tp->nfree--;
+}
+
+/* slot holding name n in a hashed array, NULL if there is none */
+static struct tbl **
+tfind(struct tbl **tbls, int size, const char *n, unsigned int h)
+{
+	struct tbl **pp, *p;
+
+	for (pp = &tbls[h & (size-1)]; (p = *pp) != NULL; pp--) {
+		if (p->hval == h && strcmp(p->name, n) == 0)
+			return pp;
+		if (pp == tbls) /* wrap */
+			pp += size;
+	}
+	return NULL;
+}
+
+/*
+ * Take p out of a hashed array.  The slot is refilled by shifting up
+ * entries further down the probe sequence, so no tombstone is left behind.
+ * Returns 0 if p is not in the array.
+ */
+static int
+tdelete(struct tbl **tbls, int size, struct tbl *p)
+{
+	unsigned int mask = size - 1;
+	unsigned int i, j, k;
+	struct tbl *q;
+
+	for (i = p->hval & mask; tbls[i] != p; i = (i - 1) & mask)
+		if (tbls[i] == NULL)
+			return 0;
+
+	for (j = (i - 1) & mask; (q = tbls[j]) != NULL; j = (j - 1) & mask) {
+		/* move q up if slot i comes before slot j when probing for q */
+		k = q->hval & mask;
+		if (((k - i) & mask) < ((k - j) & mask)) {
+			tbls[i] = q;
+			i = j;
 		}
-	afree(otblp, tp->areap);
+	}
+	tbls[i] = NULL;
+	return 1;
+}
+
+/* smallest table size that holds n entries at most half full */
+static int
+tsizefor(int n)
+{
+	int size = INIT_TBLS;
+
+	while (size / 2 < n) {
+		if (size > INT_MAX/2)
+			internal_errorf("too many vars");
+		size *= 2;
+	}
+	return size;
+}
+
+/* number of entries in the (new) array */
+static int
+tcount(struct table *tp)
+{
+	int i, n = 0;
+
+	for (i = 0; i < tp->size; i++)
+		if (tp->tbls[i] != NULL)
+			n++;
+	return n;
 }
 
 /* table */
@@ -87,20 +241,23 @@ texpand(struct table *tp, int nsize)
 struct tbl *
 ktsearch(struct table *tp, const char *n, unsigned int h)
 {
-	struct tbl **pp, *p;
+	struct tbl **pp;
 
-	if (tp->size == 0)
+	if (tp->size == 0) {
+		tp->nmiss++;
 		return NULL;
+	}
 
+	tmigrate(tp, TMIGRATE, 0);
 	/* search for name in hashed table */
-	for (pp = &tp->tbls[h & (tp->size-1)]; (p = *pp) != NULL; pp--) {
-		if (*p->name == *n && strcmp(p->name, n) == 0 &&
-		    (p->flag&DEFINED))
-			return p;
-		if (pp == tp->tbls) /* wrap */
-			pp += tp->size;
+	pp = tfind(tp->tbls, tp->size, n, h);
+	if (pp == NULL && tp->otbls != NULL)
+		pp = tfind(tp->otbls, tp->osize, n, h);
+	if (pp != NULL && ((*pp)->flag&DEFINED)) {
+		tp->nhit++;
+		return *pp;
 	}
-
+	tp->nmiss++;
 	return NULL;
 }
 
@@ -110,54 +267,163 @@ ktsearch(struct table *tp, const char *n, unsigned int h)
 struct tbl *
 ktenter(struct table *tp, const char *n, unsigned int h)
 {
-	struct tbl **pp, *p;
+	struct tbl **pp, **dpp, **opp, *p;
 	int len;
 
 	if (tp->size == 0)
 		texpand(tp, INIT_TBLS);
+	tmigrate(tp, TMIGRATE, 1);
   Search:
+	dpp = NULL;
 	/* search for name in hashed table */
 	for (pp = &tp->tbls[h & (tp->size-1)]; (p = *pp) != NULL; pp--) {
-		if (*p->name == *n && strcmp(p->name, n) == 0)
+		if (p->hval == h && strcmp(p->name, n) == 0)
 			return p;	/* found */
+		/* remember the first dead entry, its slot can be reused */
+		if (dpp == NULL && p->flag == 0)
+			dpp = pp;
 		if (pp == tp->tbls) /* wrap */
 			pp += tp->size;
 	}
-
-	if (tp->nfree <= 0) {	/* too full */
-		if (tp->size <= INT_MAX/2)
-			texpand(tp, 2*tp->size);
-		else
-			internal_errorf("too many vars");
+	if (tp->otbls != NULL &&
+	    (opp = tfind(tp->otbls, tp->osize, n, h)) != NULL)
+		return *opp;	/* found, not moved yet */
+
+	if (dpp != NULL) {
+		tbfree(*dpp);
+		pp = dpp;
+	} else if (tp->nfree <= 0) {	/* too full */
+		tmigrate(tp, tp->oleft, 1);
+		texpand(tp, tsizefor(tcount(tp) + 1));
 		goto Search;
-	}
+	} else
+		tp->nfree--;
 
 	/* create new tbl entry */
 	len = strlen(n) + 1;
-	p = alloc(offsetof(struct tbl, name[0]) + len,
-				 tp->areap);
+	p = tballoc(len);
 	p->flag = 0;
 	p->type = 0;
 	p->areap = tp->areap;
 	p->u2.field = 0;
 	p->u.array = NULL;
+	p->sval = NULL;
+	p->hval = h;
+	p->spec = V_NONE;
 	memcpy(p->name, n, len);
 
 	/* enter in tp->tbls */
-	tp->nfree--;
 	*pp = p;
 	return p;
 }
 
+/*
+ * Remove an entry from a table and free it (unless it is a function that
+ * is being executed, see comexec()).  A table that has become mostly
+ * empty is shrunk.
+ */
 void
-ktdelete(struct tbl *p)
+ktdelete(struct table *tp, struct tbl *p)
 {
-	p->flag = 0;
+	int used;
+
+	if (tp->size == 0)
+		return;
+	if (tdelete(tp->tbls, tp->size, p))
+		tp->nfree++;
+	else if (tp->otbls == NULL || !tdelete(tp->otbls, tp->osize, p))
+		return;		/* not in this table */
+	if (!(p->flag & FINUSE))
+		tbfree(p);
+
+	used = 7*tp->size/10 - tp->nfree;
+	if (tp->otbls == NULL && tp->size > INIT_TBLS && used < tp->size/8)
+		texpand(tp, tsizefor(tcount(tp)));
+}
+
+/* Finish an incremental resize, for code that goes through tp->tbls. */
+void
+ktrehash(struct table *tp)
+{
+	tmigrate(tp, tp->oleft, 0);
+}
+
+/* Give back the entries (not their values) and the slots of a table,
+ * eg, before the area it lives in is freed.
+ */
+void
+ktfreeall(struct table *tp)
+{
+	int i;
+
+	ktrehash(tp);
+	for (i = 0; i < tp->size; i++)
+		if (tp->tbls[i] != NULL)
+			tbfree(tp->tbls[i]);
+	afree(tp->tbls, tp->areap);
+	tp->tbls = NULL;
+	tp->size = tp->nfree = 0;
+}
+
+static int
+tblclass(size_t len)
+{
+	int i;
+
+	for (i = 0; i < NELEM(tblnamecap); i++)
+		if (len <= tblnamecap[i])
+			return i;
+	return -1;
+}
+
+/* allocate a table entry with room for a name of len bytes (incl. NUL) */
+struct tbl *
+tballoc(size_t len)
+{
+	struct tbl *p;
+	size_t size;
+	char *slab;
+	int c, i;
+
+	if ((c = tblclass(len)) < 0)
+		return alloc(offsetof(struct tbl, name[0]) + len, APERM);
+	if (tblpool[c] == NULL) {
+		size = offsetof(struct tbl, name[0]) + tblnamecap[c];
+		size = (size + sizeof(int64_t) - 1) & ~(sizeof(int64_t) - 1);
+		slab = areallocarray(NULL, TBL_SLAB, size, APERM);
+		for (i = 0; i < TBL_SLAB; i++) {
+			p = (struct tbl *)(slab + i * size);
+			p->u.next = tblpool[c];
+			tblpool[c] = p;
+		}
+	}
+	p = tblpool[c];
+	tblpool[c] = p->u.next;
+	return p;
+}
+
+/* Return an entry to its pool.  The name of an entry never changes, so
+ * this finds the class it was allocated from (array elements have an
+ * empty name, see arraysearch()).
+ */
+void
+tbfree(struct tbl *p)
+{
+	int c;
+
+	if ((c = tblclass(strlen(p->name) + 1)) < 0) {
+		afree(p, APERM);
+		return;
+	}
+	p->u.next = tblpool[c];
+	tblpool[c] = p;
 }
 
 void
 ktwalk(struct tstate *ts, struct table *tp)
 {
+	/* so lookups made while walking can't move entries around */
+	ktrehash(tp);
 	ts->left = tp->size;
 	ts->next = tp->tbls;
 }
@@ -187,7 +453,7 @@ ktsort(struct table *tp)
 	int i;
 	struct tbl **p, **sp, **dp;
 
-	p = areallocarray(NULL, tp->size + 1,
+	p = areallocarray(NULL, tp->size + tp->osize + 1,
 	    sizeof(struct tbl *), ATEMP);
 	sp = tp->tbls;		/* source */
 	dp = p;			/* dest */
@@ -195,55 +461,55 @@ ktsort(struct table *tp)
 		if ((*dp = *sp++) != NULL && (((*dp)->flag&DEFINED) ||
 		    ((*dp)->flag&ARRAY)))
 			dp++;
+	/* and what is left of the old array during a resize */
+	for (sp = tp->otbls, i = 0; i < tp->osize; i++)
+		if ((*dp = *sp++) != NULL && (((*dp)->flag&DEFINED) ||
+		    ((*dp)->flag&ARRAY)))
+			dp++;
 	i = dp - p;
 	qsortp((void**)p, (size_t)i, tnamecmp);
 	p[i] = NULL;
 	return p;
 }
 
-#ifdef PERF_DEBUG /* performance debugging */
-
-void tprintinfo(struct table *tp);
+/* probe length of the entry in slot i of a hashed array */
+static int
+tprobelen(struct tbl **tbls, int size, int i)
+{
+	return ((tbls[i]->hval - i) & (size - 1)) + 1;
+}
 
-void
-tprintinfo(struct table *tp)
-{
-	struct tbl *te;
-	char *n;
-	unsigned int h;
-	int ncmp;
-	int totncmp = 0, maxncmp = 0;
-	int nentries = 0;
-	struct tstate ts;
-
-	shellf("table size %d, nfree %d\n", tp->size, tp->nfree);
-	shellf("    Ncmp name\n");
-	ktwalk(&ts, tp);
-	while ((te = ktnext(&ts))) {
-		struct tbl **pp, *p;
-
-		h = hash(n = te->name);
-		ncmp = 0;
-
-		/* taken from ktsearch() and added counter */
-		for (pp = &tp->tbls[h & (tp->size-1)]; (p = *pp); pp--) {
-			ncmp++;
-			if (*p->name == *n && strcmp(p->name, n) == 0 &&
-			    (p->flag&DEFINED))
-				break; /* return p; */
-			if (pp == tp->tbls) /* wrap */
-				pp += tp->size;
+static void
+tstatarray(struct tstats *st, struct tbl **tbls, int size)
+{
+	int i, n;
+
+	for (i = 0; i < size; i++) {
+		if (tbls[i] == NULL)
+			continue;
+		if (!(tbls[i]->flag&DEFINED)) {
+			st->dead++;
+			continue;
 		}
-		shellf("    %4d %s\n", ncmp, n);
-		totncmp += ncmp;
-		nentries++;
-		if (ncmp > maxncmp)
-			maxncmp = ncmp;
+		st->live++;
+		n = tprobelen(tbls, size, i);
+		if (n > st->maxprobe)
+			st->maxprobe = n;
+		st->probes[n < NPROBEHIST ? n - 1 : NPROBEHIST - 1]++;
 	}
-	if (nentries)
-		shellf("  %d entries, worst ncmp %d, avg ncmp %d.%02d\n",
-		    nentries, maxncmp,
-		    totncmp / nentries,
-		    (totncmp % nentries) * 100 / nentries);
 }
-#endif /* PERF_DEBUG */
+
+/* Gather the health counters of a table, for c_memstat(). */
+void
+ktstats(struct table *tp, struct tstats *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->size = tp->size;
+	st->osize = tp->osize;
+	st->hits = tp->nhit;
+	st->misses = tp->nmiss;
+	if (tp->tbls != NULL)
+		tstatarray(st, tp->tbls, tp->size);
+	if (tp->otbls != NULL)
+		tstatarray(st, tp->otbls, tp->osize);
+}
@@ -10,8 +10,25 @@ struct table {
 	Area   *areap;		/* area to allocate entries */
 	int	size, nfree;	/* hash size (always 2^^n), free entries */
 	struct	tbl **tbls;	/* hashed table items */
+	struct	tbl **otbls;	/* items not moved yet while resizing */
+	int	osize;		/* size of otbls */
+	int	onext, oleft;	/* next otbls slot to move, slots left */
+	unsigned long nhit, nmiss;	/* ktsearch() counters */
 };
 
+#define NPROBEHIST	8	/* probe lengths 1..7 and 8 or more */
+
+/* table health, see ktstats() */
+struct tstats {
+	int	size, osize;	/* slots, and old slots while resizing */
+	int	live, dead;	/* defined entries, others still in slots */
+	int	maxprobe;	/* longest probe sequence to a live entry */
+	int	probes[NPROBEHIST];	/* live entries by probe length */
+	unsigned long hits, misses;
+};
+
+struct array;
+
 struct tbl {			/* table item */
 	int	flag;		/* flags */
 	int	type;		/* command type (see below), base (if INTEGER),
@@ -20,21 +37,32 @@ struct tbl {			/* table item */
 	union {
 		char *s;	/* string */
 		int64_t i;	/* integer */
+		int64_t *ip;	/* shared integer (if SHARED) */
 		int (*f)(char **);	/* int function */
 		struct op *t;	/* "function" tree */
 	} val;			/* value */
-	int	index;		/* index for an array */
+	int	index;		/* index for an array (-1 for an element of
+				 * an associative array, named by its key) */
 	union {
 	    int	field;		/* field with for -L/-R/-Z */
 	    int errno_;		/* CEXEC/CTALIAS */
 	} u2;
 	union {
-		struct tbl *array;	/* array values */
+		struct array *array;	/* array elements, see arraysearch() */
+		struct tbl *base;	/* array element: the array ([0]) */
+		struct tbl *next;	/* free list, see tballoc() */
 		char *fpath;		/* temporary path to undef function */
 	} u;
+	char	*sval;		/* string of an integer value (see str_val()) */
+	unsigned int hval;	/* hash(name), if entered in a table */
+	unsigned char spec;	/* V_* value of a variable's name */
 	char	name[4];	/* name -- variable length */
 };
 
+/* name of a variable, array elements have the one of the array */
+#define	VARNAME(vp)	((vp)->flag & ARRAY && (vp)->index ? \
+			    (vp)->u.base->name : (vp)->name)
+
 /* common flag bits */
 #define	ALLOC		BIT(0)	/* val.s has been allocated */
 #define	DEFINED		BIT(1)	/* is defined in block */
@@ -47,6 +75,7 @@ struct tbl {			/* table item */
 #define	INTEGER		BIT(9)	/* val.i contains integer value */
 #define	RDONLY		BIT(10)	/* read-only variable */
 #define	LOCAL		BIT(11)	/* for local typeset() */
+#define	ASSOC		BIT(12)	/* associative array (with ARRAY) */
 #define ARRAY		BIT(13)	/* array */
 #define LJUST		BIT(14)	/* left justify */
 #define RJUST		BIT(15)	/* right justify */
@@ -59,6 +88,8 @@ struct tbl {			/* table item */
 #define LOCAL_COPY	BIT(22)	/* with LOCAL - copy attrs from existing var */
 #define EXPRINEVAL	BIT(23)	/* contents currently being evaluated */
 #define EXPRLVALUE	BIT(24)	/* useable as lvalue (temp flag) */
+#define NAMEREF		BIT(25)	/* value is the name of another variable */
+#define SHARED		BIT(26)	/* integer value is shared with children */
 /* flag bits used for taliases/builtins/aliases/keywords/functions */
 #define KEEPASN		BIT(8)	/* keep command assignments (eg, var=x cmd) */
 #define FINUSE		BIT(9)	/* function being executed */
@@ -70,7 +101,7 @@ struct tbl {			/* table item */
  * should be repoted by set/typeset).  Does not include ARRAY or LOCAL.
  */
 #define USERATTRIB	(EXPORT|INTEGER|RDONLY|LJUST|RJUST|ZEROFIL\
-			 |LCASEV|UCASEV_AL|INT_U|INT_L)
+			 |LCASEV|UCASEV_AL|INT_U|INT_L|ASSOC|NAMEREF|SHARED)
 
 /* command types */
 #define	CNONE	0		/* undefined */
@@ -187,7 +218,12 @@ unsigned int	hash(const char *);
 void		ktinit(struct table *, Area *, int);
 struct tbl *	ktsearch(struct table *, const char *, unsigned int);
 struct tbl *	ktenter(struct table *, const char *, unsigned int);
-void		ktdelete(struct tbl *);
+void		ktdelete(struct table *, struct tbl *);
+void		ktrehash(struct table *);
+void		ktfreeall(struct table *);
+struct tbl *	tballoc(size_t);
+void		tbfree(struct tbl *);
 void		ktwalk(struct tstate *, struct table *);
 struct tbl *	ktnext(struct tstate *);
 struct tbl **	ktsort(struct table *);
+void		ktstats(struct table *, struct tstats *);
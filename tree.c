@@ -17,6 +17,7 @@ static void	tputC(int, struct shf *);
 static void	tputS(char *, struct shf *);
 static void	vfptreef(struct shf *, int, const char *, va_list);
 static struct ioword **iocopy(struct ioword **, Area *);
+static char **plaincopy(char **, char **, Area *);
 static void     iofree(struct ioword **, Area *);
 
 /*
@@ -261,7 +262,7 @@ tputC(int c, struct shf *shf)
 static void
 tputS(char *wp, struct shf *shf)
 {
-	int c, quoted=0;
+	int c, quoted=0, nest=0, array=0;
 
 	/* problems:
 	 *	`...` -> $(...)
@@ -277,6 +278,10 @@ tputS(char *wp, struct shf *shf)
 		case CHAR:
 			tputC(*wp++, shf);
 			break;
+		case CHARS:
+			for (c = (unsigned char)*wp++; c > 0; c--)
+				tputc(*wp++, shf);
+			break;
 		case QCHAR:
 			c = *wp++;
 			if (!quoted || (c == '"' || c == '`' || c == '$'))
@@ -321,13 +326,19 @@ tputS(char *wp, struct shf *shf)
 				tputc('}', shf);
 			break;
 		case OPAT:
-			tputc(*wp++, shf);
+			/* the (...) of name=(...) (see wdarray()) */
+			if ((c = *wp++) == '(')
+				array = 1;
+			else
+				tputc(c, shf);
 			tputc('(', shf);
+			nest++;
 			break;
 		case SPAT:
-			tputc('|', shf);
+			tputc(array && nest == 1 ? ' ' : '|', shf);
 			break;
 		case CPAT:
+			nest--;
 			tputc(')', shf);
 			break;
 		}
@@ -471,15 +482,40 @@ tcopy(struct op *t, Area *ap)
 		*rw = NULL;
 	}
 
+	r->pargs = plaincopy(t->pargs, t->type == TPAT ? t->vars : t->args,
+	    ap);
+	r->pvars = plaincopy(t->pvars, t->vars, ap);
+
 	r->ioact = (t->ioact == NULL) ? NULL : iocopy(t->ioact, ap);
 
 	r->left = tcopy(t->left, ap);
 	r->right = tcopy(t->right, ap);
 	r->lineno = t->lineno;
 
+	/* refers to the strings of the copied arms */
+	r->ctab = t->ctab == NULL ? NULL : casetab(r->left, ap);
+	r->texpr = t->texpr == NULL ? NULL : dbtest_compile(r->args, ap);
+
 	return r;
 }
 
+/* copy pw, the plain strings of words wp (see wdplain()) */
+static char **
+plaincopy(char **pw, char **wp, Area *ap)
+{
+	char **rw;
+	int i, n;
+
+	if (pw == NULL)
+		return NULL;
+	for (n = 0; wp[n] != NULL; n++)
+		;
+	rw = areallocarray(NULL, n + 1, sizeof(*rw), ap);
+	for (i = 0; i <= n; i++)
+		rw[i] = str_save(pw[i], ap);
+	return rw;
+}
+
 char *
 wdcopy(const char *wp, Area *ap)
 {
@@ -501,6 +537,9 @@ wdscan(const char *wp, int c)
 		case QCHAR:
 			wp++;
 			break;
+		case CHARS:
+			wp += 1 + (unsigned char)*wp;
+			break;
 		case COMSUB:
 		case EXPRSUB:
 			while (*wp++ != 0)
@@ -563,6 +602,11 @@ wdstrip(const char *wp)
 		case QCHAR:
 			shf_putchar(*wp++, &shf);
 			break;
+		case CHARS:
+			c = (unsigned char)*wp++;
+			shf_write(wp, c, &shf);
+			wp += c;
+			break;
 		case COMSUB:
 			shf_putchar('$', &shf);
 			shf_putchar('(', &shf);
@@ -607,6 +651,240 @@ wdstrip(const char *wp)
 		}
 }
 
+/* If word wp is an array assignment, name=(item ...) or name+=(item ...),
+ * return where its (...) starts, else NULL.  The (...) is OPAT '(' with
+ * the items separated by SPAT, then CPAT (see array_word() in syn.c).
+ */
+char *
+wdarray(const char *wp)
+{
+	const char *p = skip_wdvarname(wp, false);
+
+	if (p == wp)
+		return NULL;
+	if (p[0] == CHAR && p[1] == '+')
+		p += 2;
+	if (p[0] != CHAR || p[1] != '=' || p[2] != OPAT || p[3] != '(')
+		return NULL;
+	return (char *) p + 2;
+}
+
+/* Split the (...) at wp (see wdarray()) into a NULL terminated list of
+ * words, allocated from ATEMP.
+ */
+char **
+wditems(const char *wp)
+{
+	XPtrV items;
+	const char *p, *q;
+	char *w;
+	size_t len;
+	bool last;
+
+	XPinit(items, 8);
+	for (p = wp + 2; *p != CPAT; p = q) {
+		/* the last item runs into the closing CPAT and EOS */
+		q = wdscan(p, SPAT);
+		last = q[-1] != SPAT;
+		len = q - p - (last ? 2 : 1);
+		w = alloc(len + 1, ATEMP);
+		memcpy(w, p, len);
+		w[len] = EOS;
+		XPput(items, w);
+		if (last)
+			break;
+	}
+	XPput(items, NULL);
+	return (char **) XPclose(items);
+}
+
+/* If word wp needs no expansion (only quotes and literal characters,
+ * and no unquoted ~, or glob or brace characters in an argument), return
+ * its value, else NULL.
+ */
+char *
+wdplain(const char *wp, bool arg, Area *ap)
+{
+	const char *p;
+	char *s, *dp;
+	size_t len = 0;
+	int quoted = 0;
+
+	for (p = wp; *p != EOS; )
+		switch (*p) {
+		case CHAR:
+			if (!quoted && (p[1] == '~' || (arg &&
+			    (p[1] == '*' || p[1] == '?' || p[1] == '[' ||
+			    p[1] == OBRACE))))
+				return NULL;
+			/* FALLTHROUGH */
+		case QCHAR:
+			len++;
+			p += 2;
+			break;
+		case CHARS:
+			len += (unsigned char)p[1];
+			p += 2 + (unsigned char)p[1];
+			break;
+		case OQUOTE:
+			quoted = 1;
+			p++;
+			break;
+		case CQUOTE:
+			quoted = 0;
+			p++;
+			break;
+		default:
+			return NULL;
+		}
+
+	dp = s = alloc(len + 1, ap);
+	for (p = wp; *p != EOS; )
+		switch (*p) {
+		case CHAR:
+		case QCHAR:
+			*dp++ = p[1];
+			p += 2;
+			break;
+		case CHARS:
+			memcpy(dp, p + 2, (unsigned char)p[1]);
+			dp += (unsigned char)p[1];
+			p += 2 + (unsigned char)p[1];
+			break;
+		default:
+			p++;
+			break;
+		}
+	*dp = '\0';
+	return s;
+}
+
+/* If word wp needs no substitutions (only quotes, literal characters,
+ * patterns, and no unquoted ~), return what expanding it with DOPAT
+ * gives, else NULL.
+ */
+char *
+wdpattern(const char *wp, Area *ap)
+{
+	const char *p;
+	char *s, *dp;
+	int quoted = 0;
+
+	/* at worst every character gets a MAGIC */
+	dp = s = alloc(2 * strlen(wp) + 1, ap);
+	for (p = wp; *p != EOS; )
+		switch (*p) {
+		case CHAR:
+			if (!quoted) {
+				if (p[1] == '~') {
+					afree(s, ap);
+					return NULL;
+				}
+				if (strchr("[!-]*?", p[1]) != NULL)
+					*dp++ = MAGIC;
+			}
+			/* FALLTHROUGH */
+		case QCHAR:
+			if (ISMAGIC(p[1]))
+				*dp++ = MAGIC;
+			*dp++ = p[1];
+			p += 2;
+			break;
+		case CHARS:
+			memcpy(dp, p + 2, (unsigned char)p[1]);
+			dp += (unsigned char)p[1];
+			p += 2 + (unsigned char)p[1];
+			break;
+		case OQUOTE:
+			quoted = 1;
+			p++;
+			break;
+		case CQUOTE:
+			quoted = 0;
+			p++;
+			break;
+		case OPAT:
+			*dp++ = MAGIC;
+			*dp++ = p[1] | 0x80;
+			p += 2;
+			break;
+		case SPAT:
+			*dp++ = MAGIC;
+			*dp++ = '|';
+			p++;
+			break;
+		case CPAT:
+			*dp++ = MAGIC;
+			*dp++ = ')';
+			p++;
+			break;
+		default:
+			afree(s, ap);
+			return NULL;
+		}
+	*dp = '\0';
+	return s;
+}
+
+/* Hash the literal patterns of case arms (see TPAT pargs), if there are
+ * enough of them for it to pay off.
+ */
+struct casetab *
+casetab(struct op *arms, Area *ap)
+{
+	struct casetab *ct;
+	struct caseent *ce;
+	struct op *t;
+	int i, arm, n = 0;
+	unsigned int size, h;
+
+	for (t = arms; t != NULL && t->type == TPAT; t = t->right)
+		for (i = 0; t->pargs != NULL && t->vars[i] != NULL; i++)
+			if (t->pargs[i] != NULL)
+				n++;
+	if (n < 4)
+		return NULL;
+	for (size = 8; size < 2 * (unsigned int)n; size <<= 1)
+		;
+	ct = alloc(sizeof(*ct), ap);
+	ct->ent = areallocarray(NULL, size, sizeof(*ct->ent), ap);
+	memset(ct->ent, 0, size * sizeof(*ct->ent));
+	ct->mask = size - 1;
+	for (arm = 0, t = arms; t != NULL && t->type == TPAT;
+	    arm++, t = t->right)
+		for (i = 0; t->pargs != NULL && t->vars[i] != NULL; i++) {
+			if (t->pargs[i] == NULL)
+				continue;
+			h = hash(t->pargs[i]);
+			for (ce = &ct->ent[h & ct->mask]; ce->pat != NULL;
+			    ce = &ct->ent[(ce - ct->ent + 1) & ct->mask])
+				if (ce->hval == h && !strcmp(ce->pat,
+				    t->pargs[i]))
+					break;
+			/* the first arm wins */
+			if (ce->pat == NULL) {
+				ce->pat = t->pargs[i];
+				ce->hval = h;
+				ce->arm = arm;
+			}
+		}
+	return ct;
+}
+
+/* the arm whose literal pattern is s, or -1 */
+int
+caselookup(struct casetab *ct, const char *s)
+{
+	struct caseent *ce;
+	unsigned int h = hash(s);
+
+	for (ce = &ct->ent[h & ct->mask]; ce->pat != NULL;
+	    ce = &ct->ent[(ce - ct->ent + 1) & ct->mask])
+		if (ce->hval == h && !strcmp(ce->pat, s))
+			return ce->arm;
+	return -1;
+}
+
 static	struct ioword **
 iocopy(struct ioword **iow, Area *ap)
 {
@@ -644,12 +922,26 @@ void
 tfree(struct op *t, Area *ap)
 {
 	char **w;
+	int i;
 
 	if (t == NULL)
 		return;
 
 	afree(t->str, ap);
 
+	if (t->pargs != NULL) {
+		w = t->type == TPAT ? t->vars : t->args;
+		for (i = 0; w[i] != NULL; i++)
+			afree(t->pargs[i], ap);
+		afree(t->pargs, ap);
+	}
+
+	if (t->pvars != NULL) {
+		for (i = 0; t->vars[i] != NULL; i++)
+			afree(t->pvars[i], ap);
+		afree(t->pvars, ap);
+	}
+
 	if (t->vars != NULL) {
 		for (w = t->vars; *w != NULL; w++)
 			afree(*w, ap);
@@ -662,6 +954,13 @@ tfree(struct op *t, Area *ap)
 		afree(t->args, ap);
 	}
 
+	dbtest_free(t->texpr, ap);
+
+	if (t->ctab != NULL) {
+		afree(t->ctab->ent, ap);
+		afree(t->ctab, ap);
+	}
+
 	if (t->ioact != NULL)
 		iofree(t->ioact, ap);
 
@@ -17,6 +17,16 @@ struct op {
 	} u;
 	char  **args;			/* arguments to a command */
 	char  **vars;			/* variable assignments */
+	char  **pargs;			/* TCOM: args as plain strings, if
+					 * none needs expanding;
+					 * TPAT: literal patterns as plain
+					 * strings, NULL for the others */
+	char  **pvars;			/* TCOM: vars as plain strings, NULL
+					 * where one needs expanding;
+					 * TPAT: patterns as expanded, NULL
+					 * where one needs substitutions */
+	struct casetab *ctab;		/* TCASE: literal patterns hashed */
+	struct test_expr *texpr;	/* TDBRACKET: args parsed */
 	struct ioword	**ioact;	/* IO actions (eg, < > >>) */
 	struct op *left, *right;	/* descendents */
 	char   *str;			/* word for case; identifier for for,
@@ -52,6 +62,19 @@ struct op {
 #define	TEXEC		21	/* fork/exec eval'd TCOM */
 #define TCOPROC		22	/* coprocess |& */
 
+/*
+ * The literal patterns of a case (see TPAT pargs), hashed to the first
+ * arm (counting from 0) they appear in.
+ */
+struct casetab {
+	struct caseent {
+		const char *pat;	/* NULL if the slot is free */
+		unsigned int hval;	/* hash(pat) */
+		int	arm;
+	} *ent;
+	unsigned int mask;		/* number of slots - 1 */
+};
+
 /*
  * prefix codes for words in command tree
  */
@@ -67,6 +90,8 @@ struct op {
 #define OPAT	9		/* open pattern: *(, @(, etc. */
 #define SPAT	10		/* separate pattern: | */
 #define CPAT	11		/* close pattern: ) */
+#define CHARS	12		/* run of unquoted letters, digits, _ and .:
+				 * length (2 to 255), characters */
 
 /*
  * IO redirection
@@ -142,4 +167,10 @@ struct op *	tcopy(struct op *, Area *);
 char *	wdcopy(const char *, Area *);
 char *	wdscan(const char *, int);
 char *	wdstrip(const char *);
+char *	wdarray(const char *);
+char **	wditems(const char *);
+char *	wdplain(const char *, bool, Area *);
+char *	wdpattern(const char *, Area *);
+struct casetab *casetab(struct op *, Area *);
+int	caselookup(struct casetab *, const char *);
 void	tfree(struct op *, Area *);
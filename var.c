@@ -1,5 +1,6 @@
 /*	$OpenBSD: var.c,v 1.73 2023/07/23 23:42:03 kn Exp $	*/
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 
@@ -7,6 +8,7 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -33,19 +35,146 @@
  * WARNING: unreadable code, needs a rewrite
  *
  * if (flag&INTEGER), val.i contains integer value, and type contains base.
+ * if (flag&SHARED), val.ip points to the integer value instead.
  * otherwise, (val.s + type) contains string value.
  * if (flag&EXPORT), val.s contains "name=value" for E-Z exporting.
+ * if (flag&ALLOC), val.s is the string of a struct vbuf (see vsave()).
  */
+
+/*
+ * Allocated string values know their length and the size of their
+ * buffer, so appending (x+=y) can grow them geometrically in place
+ * instead of copying the whole value every time.
+ *
+ * A buffer may be shared by several variables (b=$a): it is reference
+ * counted and copied before it is modified (see vshare()).  Only
+ * variables in the buffer's own Area, or any variable if the buffer lives
+ * in the outermost block, may hold a reference, so popblock() can drop
+ * the references its variables hold before releasing their Area.
+ */
+struct vbuf {
+	Area	*areap;		/* where the buffer was allocated */
+	size_t	len;		/* strlen(str) */
+	size_t	size;		/* bytes available at str */
+	int	refs;		/* variables using the buffer */
+	int	nbase;		/* getint() of str: base, -1 if not a number,
+				 * 0 if not known yet (see getint()) */
+	int64_t	num;		/* getint() of str: value */
+	char	str[8];		/* value -- variable length */
+};
+
+#define	VBUF(s)		((struct vbuf *)((s) - offsetof(struct vbuf, str)))
+
+/*
+ * The last few plain values substituted by expand() (see varshare()).  An
+ * entry is only trusted while vbufgen is unchanged; it is bumped whenever
+ * a buffer is released.
+ */
+#define	NVSHARE		4
+static struct vshare {
+	struct vbuf	*vb;
+	unsigned int	gen;
+} vshares[NVSHARE];
+static int vsharenext;
+static unsigned int vbufgen = 1;
+
+#define	MAXREFS		16	/* namerefs followed by one lookup */
+
+/*
+ * The exported variables of all but the innermost block, and the pending
+ * environment, as of envgen.  makenv() only has to add the innermost
+ * block, which is usually a command's own (with $_ and any FOO=bar
+ * assignments), so the parent keeps it up to date before forking (see
+ * cacheenv()).  envgen is bumped whenever an exported value or the set of
+ * exported variables of the other blocks may have changed (see
+ * envchanged()), or one of those blocks goes away.
+ */
+static struct envcache {
+	Area		area;	/* strings of integers, the arrays below */
+	char		**envp;	/* name=value */
+	unsigned int	*hvals;	/* hash of the name of envp[i] */
+	unsigned int	*index;	/* by hash of name: 1 + i, 0 if empty */
+	unsigned int	n;	/* entries in envp */
+	unsigned int	isize;	/* of index, power of 2 */
+	struct block	*loc;	/* the innermost block, left out */
+	struct block	*top;	/* loc->next */
+	unsigned int	gen;	/* envgen it was made at, 0 if never */
+} envc;
+static unsigned int envgen = 1;
+
+/*
+ * Entries of the inherited environment that have not been imported yet,
+ * by hash of the name.  An entry is only turned into a variable when its
+ * name is first looked up (see envimport()); until then makenv() passes
+ * it on as it is.  No variable table has an entry for a pending name.
+ */
+static struct penv {
+	const char	*s;	/* name=value */
+	size_t		len;	/* of name, 0 once imported */
+	unsigned int	h;	/* hash(name) */
+} *penv;
+static unsigned int penvsize;	/* power of 2 */
+static unsigned int npenv;	/* entries not imported yet */
+
+/*
+ * Shared integers (typeset -S) live in anonymous MAP_SHARED pages, so
+ * background jobs and subshells forked after the variable got the
+ * attribute update the parent's copy.  All accesses are atomic.  A slot
+ * is never reused, a child may still be using it.
+ */
+#define	SHPAGE		4096
+#define	SHINT(vp)	((_Atomic int64_t *) (vp)->val.ip)
+#define	INTVAL(vp)	((vp)->flag & SHARED ? atomic_load(SHINT(vp)) : \
+			    (vp)->val.i)
+static int64_t	*shints;	/* next free slot */
+static size_t	nshints;	/* free slots at shints */
+
 static	struct tbl vtemp;
 static	struct table specials;
+static	unsigned int unspecials;	/* BIT(V_*) of names no longer special */
+
+/*
+ * global() remembers where it found a name, so references to globals from
+ * deep in a call chain don't probe every block on the way.  The cache is
+ * valid as long as vargen is unchanged; it is bumped whenever a variable
+ * may start shadowing another one (local()) or an entry may go away
+ * (unset(), popblock()).
+ */
+#define	NVARCACHE	64	/* power of 2 */
+static struct varcache {
+	struct tbl	*vp;
+	unsigned int	gen;
+} varcache[NVARCACHE];
+static unsigned int vargen = 1;
+
 static char	*formatstr(struct tbl *, const char *);
 static void	export(struct tbl *, const char *);
 static int	special(const char *);
+static int	varspec(struct tbl *);
 static void	unspecial(const char *);
 static void	getspec(struct tbl *);
 static void	setspec(struct tbl *);
 static void	unsetspec(struct tbl *);
+static void	clearvar(struct tbl *, int);
+static int	strint(const char *, int64_t *, bool, bool);
+static void	putint(struct tbl *, int64_t);
+static int64_t	*shint(void);
+static struct tbl *vglobal(const char *, int, struct tbl *, bool);
+static struct tbl *vlocal(const char *, bool, int);
+static struct tbl *deref(struct tbl *, char *, int, bool);
+static bool	envimport(const char *, unsigned int);
+static void	envchanged(struct tbl *);
+static char	*vsave(const char *, size_t, size_t, Area *);
+static void	vfree(char *);
+static struct vbuf *vshare(struct tbl *, const char *);
+static void	vappend(struct tbl *, const char *);
+static void	varchanged(void);
 static struct tbl *arraysearch(struct tbl *, int);
+static struct tbl *assocsearch(struct tbl *, const char *, bool);
+static void	assocdelete(struct tbl *);
+static void	arrayelem(struct tbl *, struct tbl *, int);
+static int	arraynext(struct tbl *);
+static void	arrayfree(struct tbl *);
 
 /*
  * create a new block for function calls and simple commands
@@ -81,10 +210,17 @@ void
 popblock(void)
 {
 	struct block *l = genv->loc;
-	struct tbl *vp, **vpp = l->vars.tbls, *vq;
+	struct tbl *vp, **vpp, *vq;
 	int i;
 
 	genv->loc = l->next;	/* pop block */
+	if (l->vars.size != 0)
+		varchanged();
+	/* the innermost block is not part of envc */
+	if (l->next != envc.top)
+		envgen++;
+	ktrehash(&l->vars);
+	vpp = l->vars.tbls;
 	for (i = l->vars.size; --i >= 0; )
 		if ((vp = *vpp++) != NULL && (vp->flag&SPECIAL)) {
 			if ((vq = global(vp->name))->flag & ISSET)
@@ -94,6 +230,16 @@ popblock(void)
 		}
 	if (l->flags & BF_DOGETOPTS)
 		user_opt = l->getopts_state;
+	/* recycle the table entries and drop their values' references */
+	for (vpp = l->vars.tbls, i = l->vars.size; --i >= 0; )
+		if ((vp = *vpp++) != NULL) {
+			if (vp->flag & ARRAY)
+				arrayfree(vp);
+			if (vp->flag & ALLOC)
+				vfree(vp->val.s);
+		}
+	ktfreeall(&l->vars);
+	ktfreeall(&l->funs);
 	afreeall(&l->area);
 	afree(l, ATEMP);
 }
@@ -140,58 +286,106 @@ initvar(void)
 	}
 }
 
-/* Used to calculate an array index for global()/local().  Sets *arrayp to
- * non-zero if this is an array, sets *valp to the array index, returns
- * the basename of the array.
+/* Used to find the subscript of an array reference for global()/local().
+ * Sets *subp to the subscript (in ATEMP) if this is an array reference,
+ * or to NULL, and returns the basename of the array.  The subscript is
+ * only substituted once it is known whether it is an index (see
+ * arrayindex()) or the key of an associative array (see arrayref()).
  */
 static const char *
-array_index_calc(const char *n, bool *arrayp, int *valp)
+array_index_calc(const char *n, char **subp)
 {
 	const char *p;
 	int len;
 
-	*arrayp = false;
+	*subp = NULL;
 	p = skip_varname(n, false);
 	if (p != n && *p == '[' && (len = array_ref_len(p))) {
-		char *sub, *tmp;
-		int64_t rval;
-
-		/* Calculate the value of the subscript */
-		*arrayp = true;
-		tmp = str_nsave(p+1, len-2, ATEMP);
-		sub = substitute(tmp, 0);
-		afree(tmp, ATEMP);
+		*subp = str_nsave(p+1, len-2, ATEMP);
 		n = str_nsave(n, p - n, ATEMP);
-		evaluate(sub, &rval, KSH_UNWIND_ERROR, true);
-		if (rval < 0 || rval > INT_MAX)
-			errorf("%s: subscript %" PRIi64 " out of range",
-			    n, rval);
-		*valp = rval;
-		afree(sub, ATEMP);
 	}
 	return n;
 }
 
+/* Calculate the value of the subscript sub of indexed array n */
+static int
+arrayindex(const char *n, char *sub)
+{
+	int64_t rval;
+	char *s;
+
+	s = substitute(sub, 0);
+	afree(sub, ATEMP);
+	evaluate(s, &rval, KSH_UNWIND_ERROR, true);
+	if (rval < 0 || rval > INT_MAX)
+		errorf("%s: subscript %" PRIi64 " out of range", n, rval);
+	afree(s, ATEMP);
+	return rval;
+}
+
+/* The element of existing array vp (named n) with subscript sub; see
+ * assocsearch() for peek.
+ */
+static struct tbl *
+arrayref(struct tbl *vp, const char *n, char *sub, bool peek)
+{
+	if (vp->flag & ASSOC)
+		return assocsearch(vp, keysubstitute(sub), peek);
+	return arraysearch(vp, arrayindex(n, sub));
+}
+
 /*
  * Search for variable, if not found create globally.
  */
 struct tbl *
 global(const char *n)
+{
+	return vglobal(n, 0, NULL, false);
+}
+
+/*
+ * Like global(), but a nameref is returned itself instead of the variable
+ * it refers to.
+ */
+struct tbl *
+global_noref(const char *n)
+{
+	return vglobal(n, -1, NULL, false);
+}
+
+/*
+ * Like global(), for only reading the variable: a missing element of an
+ * associative array is not created (see assocsearch()).
+ */
+struct tbl *
+global_peek(const char *n)
+{
+	return vglobal(n, 0, NULL, true);
+}
+
+/*
+ * global() and friends: refs is the number of namerefs followed so far,
+ * or -1 to not follow them; a nameref is not found by the name it refers
+ * to (self), so typeset -n a=$1 works when called as f a.
+ */
+static struct tbl *
+vglobal(const char *n, int refs, struct tbl *self, bool peek)
 {
 	struct block *l = genv->loc;
 	struct tbl *vp;
+	struct varcache *vc;
 	long	 num;
 	int c;
 	unsigned int h;
-	bool	 array;
+	char	*sub;
 	int	 val;
 
 	/* Check to see if this is an array */
-	n = array_index_calc(n, &array, &val);
+	n = array_index_calc(n, &sub);
 	h = hash(n);
 	c = (unsigned char)n[0];
 	if (!letter(c)) {
-		if (array)
+		if (sub != NULL)
 			errorf("bad substitution");
 		vp = &vtemp;
 		vp->flag = DEFINED;
@@ -235,22 +429,44 @@ global(const char *n)
 		}
 		return vp;
 	}
+	vc = &varcache[h & (NVARCACHE-1)];
+	if (vc->gen == vargen && (vp = vc->vp)->hval == h &&
+	    strcmp(vp->name, n) == 0 && (vp->flag&DEFINED) && vp != self) {
+		if (refs >= 0 && (vp->flag & (NAMEREF|ISSET)) ==
+		    (NAMEREF|ISSET))
+			return deref(vp, sub, refs, peek);
+		return sub != NULL ? arrayref(vp, n, sub, peek) : vp;
+	}
 	for (l = genv->loc; ; l = l->next) {
 		vp = ktsearch(&l->vars, n, h);
-		if (vp != NULL) {
-			if (array)
-				return arraysearch(vp, val);
+		if (vp != NULL && vp != self) {
+			if (self == NULL) {
+				vc->vp = vp;
+				vc->gen = vargen;
+			}
+			if (refs >= 0 && (vp->flag & (NAMEREF|ISSET)) ==
+			    (NAMEREF|ISSET))
+				return deref(vp, sub, refs, peek);
+			if (sub != NULL)
+				return arrayref(vp, n, sub, peek);
 			else
 				return vp;
 		}
 		if (l->next == NULL)
 			break;
 	}
+	if (npenv != 0 && envimport(n, h)) {
+		vp = ktsearch(&l->vars, n, h);
+		return sub != NULL ? arrayref(vp, n, sub, peek) : vp;
+	}
+	/* a new array is indexed; evaluate before entering the name */
+	val = sub != NULL ? arrayindex(n, sub) : 0;
 	vp = ktenter(&l->vars, n, h);
-	if (array)
+	vp->spec = special(n);
+	if (sub != NULL)
 		vp = arraysearch(vp, val);
 	vp->flag |= DEFINED;
-	if (special(n))
+	if (varspec(vp) != V_NONE)
 		vp->flag |= SPECIAL;
 	return vp;
 }
@@ -260,15 +476,21 @@ global(const char *n)
  */
 struct tbl *
 local(const char *n, bool copy)
+{
+	return vlocal(n, copy, 0);
+}
+
+static struct tbl *
+vlocal(const char *n, bool copy, int refs)
 {
 	struct block *l = genv->loc;
 	struct tbl *vp;
 	unsigned int h;
-	bool	 array;
-	int	 val;
+	char	*sub;
+	int	 val = 0;
 
 	/* Check to see if this is an array */
-	n = array_index_calc(n, &array, &val);
+	n = array_index_calc(n, &sub);
 	h = hash(n);
 	if (!letter(*n)) {
 		vp = &vtemp;
@@ -277,7 +499,21 @@ local(const char *n, bool copy)
 		vp->areap = ATEMP;
 		return vp;
 	}
+	vp = ktsearch(&l->vars, n, h);
+	if (vp != NULL && refs >= 0 &&
+	    (vp->flag & (NAMEREF|ISSET)) == (NAMEREF|ISSET))
+		return deref(vp, sub, refs, false);
+	/* a local must shadow the imported variable */
+	if (vp == NULL && npenv != 0 && envimport(n, h))
+		vp = ktsearch(&l->vars, n, h);
+	/* evaluate an index before entering the name, see global() */
+	if (sub != NULL && !(vp != NULL && (vp->flag & ASSOC)))
+		val = arrayindex(n, sub);
 	vp = ktenter(&l->vars, n, h);
+	if (!(vp->flag & DEFINED)) {
+		varchanged();	/* may shadow a variable found by global() */
+		vp->spec = special(n);
+	}
 	if (copy && !(vp->flag & DEFINED)) {
 		struct block *ll = l;
 		struct tbl *vq = NULL;
@@ -293,14 +529,34 @@ local(const char *n, bool copy)
 			vp->u2.field = vq->u2.field;
 		}
 	}
-	if (array)
-		vp = arraysearch(vp, val);
+	if (sub != NULL)
+		vp = (vp->flag & ASSOC) ?
+		    assocsearch(vp, keysubstitute(sub), false) :
+		    arraysearch(vp, val);
 	vp->flag |= DEFINED;
-	if (special(n))
+	if (varspec(vp) != V_NONE)
 		vp->flag |= SPECIAL;
 	return vp;
 }
 
+/*
+ * Return the variable the nameref vp refers to, or its element sub.
+ */
+static struct tbl *
+deref(struct tbl *vp, char *sub, int refs, bool peek)
+{
+	struct tbl *t;
+
+	if (refs >= MAXREFS)
+		errorf("%s: nameref loop", vp->name);
+	t = vglobal(str_val(vp), refs + 1, vp, peek);
+	if (sub == NULL)
+		return t;
+	if ((t->flag & ARRAY) && t->index != 0)
+		errorf("%s: bad substitution", vp->name);
+	return arrayref(t, t->name, sub, peek);
+}
+
 /* get variable string value */
 char *
 str_val(struct tbl *vp)
@@ -322,12 +578,30 @@ str_val(struct tbl *vp)
 		    "0123456789abcdefghijklmnopqrstuvwxyz";
 		uint64_t n;
 		unsigned int base;
+		int key;
+		size_t len;
+		struct vbuf *vb;
+		int64_t num = INTVAL(vp);
+
+		/*
+		 * Variables outside ATEMP keep the string in vp->sval,
+		 * tagged with the value and the base and flags it was
+		 * made with, and only redo it when one of them changed.
+		 */
+		key = vp->type | ((vp->flag & INT_U) ? 0x100 : 0) |
+		    ((vp->flag & UCASEV_AL) ? 0x200 : 0);
+		if (vp->sval != NULL && vp->areap != ATEMP &&
+		    !(vp->flag & (RJUST|LJUST))) {
+			vb = VBUF(vp->sval);
+			if (vb->num == num && vb->nbase == key)
+				return vp->sval;
+		}
 
 		s = strbuf + sizeof(strbuf);
 		if (vp->flag & INT_U)
-			n = (uint64_t) vp->val.i;
+			n = (uint64_t) num;
 		else
-			n = (vp->val.i < 0) ? -vp->val.i : vp->val.i;
+			n = (num < 0) ? -num : num;
 		base = (vp->type == 0) ? 10 : vp->type;
 		if (base < 2 || base > strlen(digits))
 			base = 10;
@@ -343,12 +617,27 @@ str_val(struct tbl *vp)
 			if (base >= 10)
 				*--s = digits[base / 10];
 		}
-		if (!(vp->flag & INT_U) && vp->val.i < 0)
+		if (!(vp->flag & INT_U) && num < 0)
 			*--s = '-';
 		if (vp->flag & (RJUST|LJUST)) /* case already dealt with */
 			s = formatstr(vp, s);
-		else
+		else if (vp->areap == ATEMP)
 			s = str_save(s, ATEMP);
+		else {
+			len = strbuf + sizeof(strbuf) - 1 - s;
+			if (vp->sval != NULL && VBUF(vp->sval)->size > len) {
+				vb = VBUF(vp->sval);
+				memcpy(vb->str, s, len + 1);
+				vb->len = len;
+			} else {
+				vfree(vp->sval);
+				vp->sval = vsave(s, len, 0, vp->areap);
+				vb = VBUF(vp->sval);
+			}
+			vb->num = num;
+			vb->nbase = key;
+			s = vp->sval;
+		}
 	}
 	return s;
 }
@@ -372,22 +661,26 @@ int
 setstr(struct tbl *vq, const char *s, int error_ok)
 {
 	const char *fs = NULL;
+	struct vbuf *vb;
 	int no_ro_check = error_ok & KSH_IGNORE_RDONLY;
 	error_ok &= ~KSH_IGNORE_RDONLY;
 	if ((vq->flag & RDONLY) && !no_ro_check) {
-		warningf(true, "%s: is read only", vq->name);
+		warningf(true, "%s: is read only", VARNAME(vq));
 		if (!error_ok)
 			errorf(NULL);
 		return 0;
 	}
 	if (!(vq->flag&INTEGER)) { /* string dest */
+		/* take the reference first, the buffer may be vq's own */
+		if ((vb = vshare(vq, s)) != NULL)
+			vb->refs++;
 		if ((vq->flag&ALLOC)) {
 			/* debugging */
 			if (s >= vq->val.s &&
-			    s <= vq->val.s + strlen(vq->val.s))
+			    s <= vq->val.s + VBUF(vq->val.s)->len)
 				internal_errorf("%s: %s=%s: assigning to self",
-				    __func__, vq->name, s);
-			afree(vq->val.s, vq->areap);
+				    __func__, VARNAME(vq), s);
+			vfree(vq->val.s);
 		}
 		vq->flag &= ~(ISSET|ALLOC);
 		vq->type = 0;
@@ -395,10 +688,14 @@ setstr(struct tbl *vq, const char *s, int error_ok)
 			fs = s = formatstr(vq, s);
 		if ((vq->flag&EXPORT))
 			export(vq, s);
-		else {
-			vq->val.s = str_save(s, vq->areap);
+		else if (vb != NULL) {
+			vq->val.s = vb->str;
 			vq->flag |= ALLOC;
-		}
+		} else if (s != NULL) {
+			vq->val.s = vsave(s, strlen(s), 0, vq->areap);
+			vq->flag |= ALLOC;
+		} else
+			vq->val.s = NULL;
 	} else {		/* integer dest */
 		if (!v_evaluate(vq, s, error_ok, true))
 			return 0;
@@ -422,8 +719,16 @@ setint(struct tbl *vq, int64_t n)
 		vp->val.i = n;
 		/* setstr can't fail here */
 		setstr(vq, str_val(vp), KSH_RETURN_ERROR);
-	} else
-		vq->val.i = n;
+		/* save getint() the trouble */
+		if ((vq->flag & (ALLOC|INTEGER|LJUST|RJUST)) == ALLOC) {
+			VBUF(vq->val.s)->num = n;
+			VBUF(vq->val.s)->nbase = 10;
+		}
+	} else {
+		putint(vq, n);
+		if (vq->flag & EXPORT)
+			envchanged(vq);
+	}
 	vq->flag |= ISSET;
 	if ((vq->flag&SPECIAL))
 		setspec(vq);
@@ -432,11 +737,8 @@ setint(struct tbl *vq, int64_t n)
 int
 getint(struct tbl *vp, int64_t *nump, bool arith)
 {
-	char *s;
-	int c;
-	int base, neg;
-	int have_base = 0;
-	int64_t num;
+	struct vbuf *vb;
+	const char *s;
 
 	if (vp->flag&SPECIAL)
 		getspec(vp);
@@ -444,12 +746,32 @@ getint(struct tbl *vp, int64_t *nump, bool arith)
 	if (!(vp->flag&ISSET) || (!(vp->flag&INTEGER) && vp->val.s == NULL))
 		return -1;
 	if (vp->flag&INTEGER) {
-		*nump = vp->val.i;
+		*nump = INTVAL(vp);
 		return vp->type;
 	}
 	s = vp->val.s + vp->type;
-	if (s == NULL)	/* redundant given initial test */
-		s = null;
+	/* the result is kept with the value, unless it depends on arith
+	 * or ZEROFIL (leading 0)
+	 */
+	if (!(vp->flag&ALLOC) || (*s == '0' && *(s+1)))
+		return strint(s, nump, arith, (vp->flag & ZEROFIL) != 0);
+	vb = VBUF(vp->val.s);
+	if (vb->nbase == 0)
+		vb->nbase = strint(s, &vb->num, arith, false);
+	if (vb->nbase > 0)
+		*nump = vb->num;
+	return vb->nbase;
+}
+
+/* parse the number in s, return its base or -1 if it is not a number */
+static int
+strint(const char *s, int64_t *nump, bool arith, bool zerofil)
+{
+	int c;
+	int base, neg;
+	int have_base = 0;
+	int64_t num;
+
 	base = 10;
 	num = 0;
 	neg = 0;
@@ -458,7 +780,7 @@ getint(struct tbl *vp, int64_t *nump, bool arith)
 		if (*s == 'x' || *s == 'X') {
 			s++;
 			base = 16;
-		} else if (vp->flag & ZEROFIL) {
+		} else if (zerofil) {
 			while (*s == '0')
 				s++;
 		} else
@@ -508,17 +830,62 @@ setint_v(struct tbl *vq, struct tbl *vp, bool arith)
 		return NULL;
 	if (!(vq->flag & INTEGER) && (vq->flag & ALLOC)) {
 		vq->flag &= ~ALLOC;
-		afree(vq->val.s, vq->areap);
+		vfree(vq->val.s);
 	}
-	vq->val.i = num;
+	putint(vq, num);
 	if (vq->type == 0) /* default base */
 		vq->type = base;
 	vq->flag |= ISSET|INTEGER;
+	if (vq->flag & EXPORT)
+		envchanged(vq);
 	if (vq->flag&SPECIAL)
 		setspec(vq);
 	return vq;
 }
 
+/* store the value of integer variable vq */
+static void
+putint(struct tbl *vq, int64_t n)
+{
+	if (vq->flag & SHARED)
+		atomic_store(SHINT(vq), n);
+	else
+		vq->val.i = n;
+}
+
+/* Set shared integer vq to new if it still is old (for expr.c's
+ * read-modify-write operators), return whether it was.
+ */
+bool
+setint_cas(struct tbl *vq, int64_t old, int64_t new)
+{
+	if (!atomic_compare_exchange_strong(SHINT(vq), &old, new))
+		return false;
+	vq->flag |= ISSET;
+	if (vq->flag & EXPORT)
+		envchanged(vq);
+	return true;
+}
+
+/* allocate a slot for a shared integer */
+static int64_t *
+shint(void)
+{
+	void *p;
+
+	if (nshints == 0) {
+		p = mmap(NULL, SHPAGE, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_ANON, -1, 0);
+		if (p == MAP_FAILED)
+			errorf("can't map shared memory: %s",
+			    strerror(errno));
+		shints = p;
+		nshints = SHPAGE / sizeof(int64_t);
+	}
+	nshints--;
+	return shints++;
+}
+
 static char *
 formatstr(struct tbl *vp, const char *s)
 {
@@ -586,31 +953,176 @@ export(struct tbl *vp, const char *val)
 {
 	char *xp;
 	char *op = (vp->flag&ALLOC) ? vp->val.s : NULL;
-	int namelen = strlen(vp->name);
-	int vallen = strlen(val) + 1;
+	size_t namelen = strlen(vp->name);
+	size_t vallen = strlen(val) + 1;
 
 	vp->flag |= ALLOC;
-	xp = alloc(namelen + 1 + vallen, vp->areap);
-	memcpy(vp->val.s = xp, vp->name, namelen);
+	xp = vsave(vp->name, namelen, namelen + 1 + vallen, vp->areap);
+	vp->val.s = xp;
 	xp += namelen;
 	*xp++ = '=';
 	vp->type = xp - vp->val.s; /* offset to value */
 	memcpy(xp, val, vallen);
-	afree(op, vp->areap);
+	VBUF(vp->val.s)->len = namelen + vallen;
+	vfree(op);
+	envchanged(vp);
+}
+
+/*
+ * Copy the len bytes at s into a new value buffer with room for at least
+ * size bytes (including the NUL), return its string.
+ */
+static char *
+vsave(const char *s, size_t len, size_t size, Area *ap)
+{
+	struct vbuf *vb;
+
+	if (size < len + 1)
+		size = len + 1;
+	if (size > SIZE_MAX - offsetof(struct vbuf, str))
+		internal_errorf("unable to allocate memory");
+	vb = alloc(offsetof(struct vbuf, str) + size, ap);
+	vb->areap = ap;
+	vb->len = len;
+	vb->size = size;
+	vb->refs = 1;
+	vb->nbase = 0;
+	memcpy(vb->str, s, len);
+	vb->str[len] = '\0';
+	return vb->str;
+}
+
+/* drop a reference to the value buffer of s */
+static void
+vfree(char *s)
+{
+	struct vbuf *vb;
+
+	if (s == NULL)
+		return;
+	vb = VBUF(s);
+	if (--vb->refs == 0) {
+		afree(vb, vb->areap);
+		vbufgen++;
+	}
+}
+
+/*
+ * Note that the value of vp is being substituted: assigning the same
+ * string to another variable can then share vp's buffer instead of
+ * copying it.
+ */
+void
+varshare(struct tbl *vp)
+{
+	struct vshare *sp;
+
+	if ((vp->flag & (ALLOC|ISSET|INTEGER|EXPORT)) != (ALLOC|ISSET) ||
+	    vp->type != 0 || vp->areap == ATEMP)
+		return;
+	sp = &vshares[vsharenext++ & (NVSHARE - 1)];
+	sp->vb = VBUF(vp->val.s);
+	sp->gen = vbufgen;
+}
+
+/*
+ * Return a noted buffer holding exactly s that vq may share, or NULL if
+ * the value has to be copied.
+ */
+static struct vbuf *
+vshare(struct tbl *vq, const char *s)
+{
+	struct vshare *sp;
+	struct vbuf *vb;
+	struct block *l;
+	size_t len = 0;
+
+	if (s == NULL || vq->areap == ATEMP ||
+	    (vq->flag & (EXPORT|UCASEV_AL|LCASEV|LJUST|RJUST)))
+		return NULL;
+	for (sp = vshares; sp < &vshares[NVSHARE]; sp++) {
+		if (sp->gen != vbufgen)
+			continue;
+		vb = sp->vb;
+		if (vb->areap != vq->areap) {
+			for (l = genv->loc; l->next != NULL; l = l->next)
+				;
+			if (vb->areap != &l->area)
+				continue;
+		}
+		if (len == 0)
+			len = strlen(s);
+		if (vb->len == len && memcmp(vb->str, s, len) == 0)
+			return vb;
+	}
+	return NULL;
+}
+
+/*
+ * Append s to the string value of vp (x+=s).  Plain allocated values are
+ * extended in place, their buffer doubling when it is full; anything
+ * that needs setstr()'s formatting or side effects is set the long way.
+ */
+static void
+vappend(struct tbl *vp, const char *s)
+{
+	struct vbuf *vb;
+	size_t len, need;
+	char *old;
+
+	if ((vp->flag & (ALLOC|ISSET|SPECIAL|UCASEV_AL|LCASEV|LJUST|RJUST)) !=
+	    (ALLOC|ISSET)) {
+		old = str_val(vp);
+		len = strlen(old);
+		old = vsave(old, len, len + strlen(s) + 1, ATEMP);
+		strlcpy(old + len, s, VBUF(old)->size - len);
+		setstr(vp, old, KSH_RETURN_ERROR | KSH_IGNORE_RDONLY);
+		vfree(old);
+		return;
+	}
+	vb = VBUF(vp->val.s);
+	len = strlen(s);
+	need = vb->len + len + 1;
+	if (need < len)
+		internal_errorf("unable to allocate memory");
+	if (vb->refs > 1 || vb->areap != vp->areap) {
+		/* shared, or taken over from an outer block: copy on write */
+		vp->val.s = vsave(vb->str, vb->len, need, vp->areap);
+		vfree(vb->str);
+		vb = VBUF(vp->val.s);
+	} else if (need > vb->size) {
+		if (need < vb->size * 2)
+			need = vb->size * 2;
+		if (need > SIZE_MAX - offsetof(struct vbuf, str))
+			internal_errorf("unable to allocate memory");
+		vb = aresize(vb, offsetof(struct vbuf, str) + need, vp->areap);
+		vb->size = need;
+		vbufgen++;	/* it may have moved */
+		vp->val.s = vb->str;
+	}
+	memcpy(vb->str + vb->len, s, len + 1);
+	vb->len += len;
+	vb->nbase = 0;
+	if (vp->flag & EXPORT)
+		envchanged(vp);
 }
 
 /*
  * lookup variable (according to (set&LOCAL)),
  * set its attributes (INTEGER, RDONLY, EXPORT, TRACE, LJUST, RJUST, ZEROFIL,
- * LCASEV, UCASEV_AL), and optionally set its value if an assignment.
+ * LCASEV, UCASEV_AL, ASSOC), and optionally set its value if an assignment
+ * (or append to it, for name+=value).
  */
 struct tbl *
 typeset(const char *var, int set, int clr, int field, int base)
 {
-	struct tbl *vp;
-	struct tbl *vpbase, *t;
+	struct tbl *vp, *vq;
+	struct tbl *vpbase, *t, **tl;
+	struct block *l;
 	char *tvar;
 	const char *val;
+	bool append = false;
+	int refs;
 
 	/* check for valid variable name, search for value */
 	val = skip_varname(var, false);
@@ -620,7 +1132,7 @@ typeset(const char *var, int set, int clr, int field, int base)
 		int len;
 
 		len = array_ref_len(val);
-		if (len == 0)
+		if (len == 0 || (set & ASSOC))
 			return NULL;
 		/* IMPORT is only used when the shell starts up and is
 		 * setting up its environment.  Allow only simple array
@@ -636,9 +1148,12 @@ typeset(const char *var, int set, int clr, int field, int base)
 		}
 		val += len;
 	}
-	if (*val == '=')
-		tvar = str_nsave(var, val++ - var, ATEMP);
-	else {
+	if (*val == '=' ||
+	    (val[0] == '+' && val[1] == '=' && !(set & IMPORT))) {
+		append = *val == '+';
+		tvar = str_nsave(var, val - var, ATEMP);
+		val += append ? 2 : 1;
+	} else {
 		/* Importing from original environment: must have an = */
 		if (set & IMPORT)
 			return NULL;
@@ -647,16 +1162,53 @@ typeset(const char *var, int set, int clr, int field, int base)
 	}
 
 	/* Prevent typeset from creating a local PATH/ENV/SHELL */
-	if (Flag(FRESTRICTED) && (strcmp(tvar, "PATH") == 0 ||
+	if (Flag(FRESTRICTED) && !(set & IMPORT) &&
+	    (strcmp(tvar, "PATH") == 0 ||
 	    strcmp(tvar, "ENV") == 0 || strcmp(tvar, "SHELL") == 0))
 		errorf("%s: restricted", tvar);
 
-	vp = (set&LOCAL) ? local(tvar, (set & LOCAL_COPY) ? true : false) :
-	    global(tvar);
+	/* typeset -n and +n work on the nameref itself */
+	refs = ((set|clr) & NAMEREF) ? -1 : 0;
+	vp = (set&LOCAL) ? vlocal(tvar, (set & LOCAL_COPY) ? true : false,
+	    refs) : vglobal(tvar, refs, NULL, false);
+
+	vpbase = (vp->flag & ARRAY) && vp->index != 0 ? vp->u.base : vp;
+	if (set & NAMEREF) {
+		if (vpbase->flag & ARRAY)
+			errorf("%s: reference variable cannot be an array",
+			    tvar);
+		if (val != NULL) {
+			const char *p = skip_varname(val, false);
+			size_t len = p - val;
+
+			if (*p == '[')
+				p += array_ref_len(p);
+			if (len == 0 || *p != '\0')
+				errorf("%s: invalid variable name", val);
+			/* a global can't refer to itself, see vglobal() */
+			if (genv->loc->next == NULL &&
+			    strncmp(val, tvar, len) == 0 && tvar[len] == '\0')
+				errorf("%s: invalid self reference", tvar);
+		}
+		clr |= INTEGER;
+	}
+	if (set & SHARED) {
+		if (vpbase->flag & (ARRAY|SPECIAL))
+			errorf("%s: can't be shared", tvar);
+		set |= INTEGER;
+	}
+	if (clr & INTEGER)
+		clr |= SHARED;
+
+	/* FOO+=bar cmd appends to a copy of the value of FOO */
+	vq = NULL;
+	if (append && (set & LOCAL_COPY) && vp == vpbase &&
+	    !(vp->flag & ISSET))
+		for (l = genv->loc->next; l != NULL; l = l->next)
+			if ((vq = ktsearch(&l->vars, tvar, vp->hval)) != NULL)
+				break;
 	set &= ~(LOCAL|LOCAL_COPY);
 
-	vpbase = (vp->flag & ARRAY) ? global(arrayname(tvar)) : vp;
-
 	/* only allow export flag to be set.  at&t ksh allows any attribute to
 	 * be changed, which means it can be truncated or modified
 	 * (-L/-R/-Z/-i).
@@ -665,16 +1217,24 @@ typeset(const char *var, int set, int clr, int field, int base)
 	    (val || clr || (set & ~EXPORT)))
 		/* XXX check calls - is error here ok by POSIX? */
 		errorf("%s: is read only", tvar);
+	if ((set & ASSOC) && !(vpbase->flag & ASSOC)) {
+		if ((vpbase->flag & ARRAY) && vpbase->u.array != NULL)
+			errorf("%s: is an indexed array", tvar);
+		vpbase->flag |= ARRAY;
+		vpbase->index = 0;
+	}
 	if (val)
 		afree(tvar, ATEMP);
 
+	if ((set | clr) & EXPORT)
+		envchanged(vpbase);
 	/* most calls are with set/clr == 0 */
 	if (set | clr) {
 		int ok = 1;
 		/* XXX if x[0] isn't set, there will be problems: need to have
 		 * one copy of attributes for arrays...
 		 */
-		for (t = vpbase; t; t = t->u.array) {
+		for (tl = arraylist(vpbase); (t = *tl) != NULL; tl++) {
 			int fake_assign;
 			int error_ok = KSH_RETURN_ERROR;
 			char *s = NULL;
@@ -703,6 +1263,17 @@ typeset(const char *var, int set, int clr, int field, int base)
 				/* allow var to be initialized read-only */
 				error_ok |= KSH_IGNORE_RDONLY;
 			}
+			if ((set & SHARED) && !(t->flag & SHARED)) {
+				int64_t *ip = shint();
+
+				/* always set: children can't tell otherwise */
+				if ((t->flag & (INTEGER|ISSET)) ==
+				    (INTEGER|ISSET))
+					*ip = t->val.i;
+				t->val.ip = ip;
+				t->flag |= ISSET;
+			} else if ((clr & SHARED) && (t->flag & SHARED))
+				t->val.i = atomic_load(SHINT(t));
 			t->flag = (t->flag | set) & ~clr;
 			/* Don't change base if assignment is to be done,
 			 * in case assignment fails.
@@ -722,19 +1293,31 @@ typeset(const char *var, int set, int clr, int field, int base)
 						t->flag &= ~ISSET;
 					else {
 						if (t->flag & ALLOC)
-							afree(t->val.s, t->areap);
+							vfree(t->val.s);
 						t->flag &= ~(ISSET|ALLOC);
+						envchanged(t);
 						t->type = 0;
 					}
 				}
-				afree(free_me, t->areap);
+				vfree(free_me);
 			}
 		}
 		if (!ok)
 		    errorf(NULL);
 	}
 
-	if (val != NULL) {
+	if (val != NULL && append) {
+		if (vq != NULL && (vq->flag & ISSET))
+			setstr(vp, str_val(vq),
+			    KSH_RETURN_ERROR | KSH_IGNORE_RDONLY);
+		if (vp->flag&INTEGER) {
+			int64_t num;
+
+			evaluate(val, &num, KSH_UNWIND_ERROR, true);
+			setint(vp, ((vp->flag&ISSET) ? intval(vp) : 0) + num);
+		} else
+			vappend(vp, val);
+	} else if (val != NULL) {
 		if (vp->flag&INTEGER) {
 			/* do not zero base before assignment */
 			setstr(vp, val, KSH_UNWIND_ERROR | KSH_IGNORE_RDONLY);
@@ -754,33 +1337,56 @@ typeset(const char *var, int set, int clr, int field, int base)
 	return vp;
 }
 
-/* Unset a variable.  array_ref is set if there was an array reference in
- * the name lookup (eg, x[2]).
+/* Drop a variable's value and attributes.  array_ref is set if there was
+ * an array reference in the name lookup (eg, x[2]).
  */
-void
-unset(struct tbl *vp, int array_ref)
+static void
+clearvar(struct tbl *vp, int array_ref)
 {
+	if (vp->flag & EXPORT)
+		envchanged(vp);
 	if (vp->flag & ALLOC)
-		afree(vp->val.s, vp->areap);
-	if ((vp->flag & ARRAY) && !array_ref) {
-		struct tbl *a, *tmp;
-
-		/* Free up entire array */
-		for (a = vp->u.array; a; ) {
-			tmp = a;
-			a = a->u.array;
-			if (tmp->flag & ALLOC)
-				afree(tmp->val.s, tmp->areap);
-			afree(tmp, tmp->areap);
-		}
-		vp->u.array = NULL;
-	}
+		vfree(vp->val.s);
+	vfree(vp->sval);
+	vp->sval = NULL;
+	if ((vp->flag & ARRAY) && !array_ref)
+		arrayfree(vp);	/* free up entire array */
 	/* If foo[0] is being unset, the remainder of the array is kept... */
 	vp->flag &= SPECIAL | (array_ref ? ARRAY|DEFINED : 0);
+	varchanged();
 	if (vp->flag & SPECIAL)
 		unsetspec(vp);	/* responsible for `unspecial'ing var */
 }
 
+/* Unset a variable, see clearvar() */
+void
+unset(struct tbl *vp, int array_ref)
+{
+	struct block *l;
+
+	clearvar(vp, array_ref);
+	/* an element of an associative array goes away with its key */
+	if (array_ref && vp->index < 0)
+		assocdelete(vp);
+	/* give back the entry once nothing is left of the variable */
+	else if (vp->flag == 0)
+		for (l = genv->loc; l != NULL; l = l->next)
+			if (vp->areap == &l->area) {
+				ktdelete(&l->vars, vp);
+				break;
+			}
+}
+
+/* invalidate the global() cache */
+static void
+varchanged(void)
+{
+	if (++vargen == 0) {
+		memset(varcache, 0, sizeof(varcache));
+		vargen = 1;
+	}
+}
+
 /* return a pointer to the first char past a legal variable name (returns the
  * argument if there is no legal name, returns * a pointer to the terminating
  * null if whole string is legal).
@@ -804,17 +1410,35 @@ char *
 skip_wdvarname(const char *s,
     int aok)				/* skip array de-reference? */
 {
-	if (s[0] == CHAR && letter(s[1])) {
-		do {
-			s += 2;
-		} while (s[0] == CHAR && letnum(s[1]));
+	const char *p;
+	int n;
+
+	if ((s[0] == CHAR && letter(s[1])) || (s[0] == CHARS && letter(s[2]))) {
+		while (1) {
+			if (s[0] == CHAR && letnum(s[1]))
+				s += 2;
+			else if (s[0] == CHARS) {
+				for (n = (unsigned char)s[1], p = s + 2;
+				    n > 0 && letnum(*p); n--)
+					p++;
+				/* a . in the run ends the name */
+				if (n > 0)
+					return (char *) p;
+				s = p;
+			} else
+				break;
+		}
 		if (aok && s[0] == CHAR && s[1] == '[') {
 			/* skip possible array de-reference */
-			const char *p = s;
 			char c;
 			int depth = 0;
 
+			p = s;
 			while (1) {
+				if (p[0] == CHARS) {
+					p += 2 + (unsigned char)p[1];
+					continue;
+				}
 				if (p[0] != CHAR)
 					break;
 				c = p[1];
@@ -840,53 +1464,241 @@ is_wdvarname(const char *s, int aok)
 	return p != s && p[0] == EOS;
 }
 
-/* Check if coded string s is a variable assignment */
+/* Check if coded string s is a variable assignment (name=, or name+=) */
 int
 is_wdvarassign(const char *s)
 {
 	char *p = skip_wdvarname(s, true);
 
+	if (p != s && p[0] == CHAR && p[1] == '+')
+		p += 2;
 	return p != s && p[0] == CHAR && p[1] == '=';
 }
 
 /*
- * Make the exported environment from the exported names in the dictionary.
+ * Remember the environment the shell was started with (see struct penv).
+ * Names that are special to the shell, and anything typeset(IMPORT)
+ * might not take as a plain name=value, are imported right away.
  */
-char **
-makenv(void)
+void
+initenv(char **wp)
 {
+	const char *p;
+	char *name;
+	struct penv *pe;
+	size_t n;
+	unsigned int h;
+
+	for (n = 0; wp[n] != NULL; n++)
+		;
+	for (penvsize = 16; penvsize < n * 2; penvsize <<= 1)
+		;
+	penv = areallocarray(NULL, penvsize, sizeof(struct penv), APERM);
+	memset(penv, 0, penvsize * sizeof(struct penv));
+	for (; *wp != NULL; wp++) {
+		p = skip_varname(*wp, false);
+		if (p == *wp || *p != '=') {
+			typeset(*wp, IMPORT|EXPORT, 0, 0, 0);
+			continue;
+		}
+		name = str_nsave(*wp, p - *wp, ATEMP);
+		h = hash(name);
+		if (special(name) != V_NONE) {
+			typeset(*wp, IMPORT|EXPORT, 0, 0, 0);
+			afree(name, ATEMP);
+			continue;
+		}
+		afree(name, ATEMP);
+		/* a later entry for a name replaces an earlier one */
+		for (pe = &penv[h & (penvsize - 1)]; pe->s != NULL;
+		    pe = &penv[(pe - penv + 1) & (penvsize - 1)])
+			if (pe->h == h && pe->len == (size_t)(p - *wp) &&
+			    strncmp(pe->s, *wp, pe->len) == 0)
+				break;
+		if (pe->s == NULL)
+			npenv++;
+		pe->s = *wp;
+		pe->len = p - *wp;
+		pe->h = h;
+	}
+}
+
+/* Import the pending environment entry for name n, if there is one */
+static bool
+envimport(const char *n, unsigned int h)
+{
+	struct penv *pe;
+	size_t len = strlen(n);
+
+	for (pe = &penv[h & (penvsize - 1)]; pe->s != NULL;
+	    pe = &penv[(pe - penv + 1) & (penvsize - 1)])
+		if (pe->h == h && pe->len == len &&
+		    strncmp(pe->s, n, len) == 0) {
+			/* typeset() looks the name up again */
+			pe->len = 0;
+			npenv--;
+			typeset(pe->s, IMPORT|EXPORT, 0, 0, 0);
+			return true;
+		}
+	return false;
+}
+
+/* Import all of the pending environment, for listing the variables */
+void
+importenv(void)
+{
+	struct penv *pe;
+
+	for (pe = penv; npenv != 0 && pe < penv + penvsize; pe++)
+		if (pe->len != 0) {
+			pe->len = 0;
+			npenv--;
+			typeset(pe->s, IMPORT|EXPORT, 0, 0, 0);
+		}
+}
+
+/* Note that exported variable vp has changed */
+static void
+envchanged(struct tbl *vp)
+{
+	/* the innermost block is not part of envc */
+	if (envc.loc == NULL || vp->areap != &envc.loc->area)
+		envgen++;
+}
+
+/* Return the entry in envc for name n (of length len), or -1 */
+static int
+envfind(const char *n, size_t len, unsigned int h)
+{
+	unsigned int i, j;
+
+	for (i = h & (envc.isize - 1); (j = envc.index[i]) != 0;
+	    i = (i + 1) & (envc.isize - 1)) {
+		j--;
+		if (envc.hvals[j] == h && strncmp(envc.envp[j], n, len) == 0 &&
+		    envc.envp[j][len] == '=')
+			return j;
+	}
+	return -1;
+}
+
+/* Add name=value s to envc, unless an inner block already exported it */
+static void
+envadd(char *s, size_t len, unsigned int h)
+{
+	unsigned int i;
+
+	if (envfind(s, len, h) >= 0)
+		return;
+	for (i = h & (envc.isize - 1); envc.index[i] != 0;
+	    i = (i + 1) & (envc.isize - 1))
+		;
+	envc.index[i] = envc.n + 1;
+	envc.hvals[envc.n] = h;
+	envc.envp[envc.n++] = s;
+}
+
+/* The name=value string of exported variable vp, allocated in ap if needed */
+static char *
+envstr(struct tbl *vp, Area *ap)
+{
+	const char *val;
+	char *s;
+	size_t len, vlen;
+
+	if (!(vp->flag & INTEGER))
+		return vp->val.s;
+	val = str_val(vp);
+	len = strlen(vp->name);
+	vlen = strlen(val);
+	s = alloc(len + 1 + vlen + 1, ap);
+	memcpy(s, vp->name, len);
+	s[len] = '=';
+	memcpy(s + len + 1, val, vlen + 1);
+	return s;
+}
+
+/* Bring envc up to date for the current block */
+void
+cacheenv(void)
+{
+	static bool inited;
 	struct block *l;
-	XPtrV env;
 	struct tbl *vp, **vpp;
+	unsigned int n, h;
+	bool dynamic = false;
 	int i;
 
-	XPinit(env, 64);
-	for (l = genv->loc; l != NULL; l = l->next)
+	if (envc.gen == envgen && envc.top == genv->loc->next)
+		return;
+	if (!inited) {
+		ainit(&envc.area);
+		inited = true;
+	}
+	afreeall(&envc.area);
+	n = npenv;
+	for (l = genv->loc->next; l != NULL; l = l->next) {
+		ktrehash(&l->vars);
+		n += l->vars.size;
+	}
+	for (envc.isize = 16; envc.isize < n * 2; envc.isize <<= 1)
+		;
+	envc.envp = areallocarray(NULL, n + 1, sizeof(char *), &envc.area);
+	envc.hvals = areallocarray(NULL, n + 1, sizeof(unsigned int),
+	    &envc.area);
+	envc.index = areallocarray(NULL, envc.isize, sizeof(unsigned int),
+	    &envc.area);
+	memset(envc.index, 0, envc.isize * sizeof(unsigned int));
+	envc.n = 0;
+	for (l = genv->loc->next; l != NULL; l = l->next) {
 		for (vpp = l->vars.tbls, i = l->vars.size; --i >= 0; )
 			if ((vp = *vpp++) != NULL &&
 			    (vp->flag&(ISSET|EXPORT)) == (ISSET|EXPORT)) {
-				struct block *l2;
-				struct tbl *vp2;
-				unsigned int h = hash(vp->name);
-
-				/* unexport any redefined instances */
-				for (l2 = l->next; l2 != NULL; l2 = l2->next) {
-					vp2 = ktsearch(&l2->vars, vp->name, h);
-					if (vp2 != NULL)
-						vp2->flag &= ~EXPORT;
-				}
-				if ((vp->flag&INTEGER)) {
-					/* integer to string */
-					char *val;
-					val = str_val(vp);
-					vp->flag &= ~(INTEGER|RDONLY);
-					/* setstr can't fail here */
-					setstr(vp, val, KSH_RETURN_ERROR);
-				}
-				XPput(env, vp->val.s);
+				/* $RANDOM and co. change by themselves */
+				if ((vp->flag & (INTEGER|SPECIAL)) ==
+				    (INTEGER|SPECIAL) || (vp->flag & SHARED))
+					dynamic = true;
+				envadd(envstr(vp, &envc.area), strlen(vp->name),
+				    vp->hval);
 			}
-	XPput(env, NULL);
-	return (char **) XPclose(env);
+	}
+	for (h = 0; npenv != 0 && h < penvsize; h++)
+		if (penv[h].len != 0)
+			envadd((char *)penv[h].s, penv[h].len, penv[h].h);
+	envc.loc = genv->loc;
+	envc.top = genv->loc->next;
+	envc.gen = dynamic ? 0 : envgen;
+}
+
+/*
+ * Make the exported environment from the exported names in the dictionary.
+ */
+char **
+makenv(void)
+{
+	char **envp;
+	struct tbl *vp, **vpp;
+	unsigned int n;
+	int i, j;
+
+	cacheenv();
+	ktrehash(&genv->loc->vars);
+	n = envc.n;
+	envp = areallocarray(NULL, n + genv->loc->vars.size + 1,
+	    sizeof(char *), ATEMP);
+	memcpy(envp, envc.envp, n * sizeof(char *));
+	for (vpp = genv->loc->vars.tbls, i = genv->loc->vars.size; --i >= 0; )
+		if ((vp = *vpp++) != NULL &&
+		    (vp->flag&(ISSET|EXPORT)) == (ISSET|EXPORT)) {
+			/* replaces an outer variable of the same name */
+			if ((j = envfind(vp->name, strlen(vp->name),
+			    vp->hval)) >= 0)
+				envp[j] = envstr(vp, ATEMP);
+			else
+				envp[n++] = envstr(vp, ATEMP);
+		}
+	envp[n] = NULL;
+	return envp;
 }
 
 /*
@@ -914,6 +1726,13 @@ special(const char *name)
 	return tp && (tp->flag & ISSET) ? tp->type : V_NONE;
 }
 
+/* V_* kind of a variable, V_NONE if it isn't or no longer is special */
+static int
+varspec(struct tbl *vp)
+{
+	return unspecials & BIT(vp->spec) ? V_NONE : vp->spec;
+}
+
 /* Make a variable non-special */
 static void
 unspecial(const char *name)
@@ -921,8 +1740,10 @@ unspecial(const char *name)
 	struct tbl *tp;
 
 	tp = ktsearch(&specials, name, hash(name));
-	if (tp)
-		ktdelete(tp);
+	if (tp) {
+		unspecials |= BIT(tp->type);
+		ktdelete(&specials, tp);
+	}
 }
 
 static	struct	timespec seconds;	/* time SECONDS last set */
@@ -931,7 +1752,7 @@ static	int	user_lineno;		/* what user set $LINENO to */
 static void
 getspec(struct tbl *vp)
 {
-	switch (special(vp->name)) {
+	switch (varspec(vp)) {
 	case V_SECONDS:
 		vp->flag &= ~SPECIAL;
 		/* On start up the value of SECONDS is used before seconds
@@ -975,7 +1796,7 @@ setspec(struct tbl *vp)
 {
 	char *s;
 
-	switch (special(vp->name)) {
+	switch (varspec(vp)) {
 	case V_PATH:
 		afree(search_path, APERM);
 		search_path = str_save(str_val(vp), APERM);
@@ -1097,7 +1918,7 @@ setspec(struct tbl *vp)
 static void
 unsetspec(struct tbl *vp)
 {
-	switch (special(vp->name)) {
+	switch (varspec(vp)) {
 	case V_PATH:
 		afree(search_path, APERM);
 		search_path = str_save(def_path, APERM);
@@ -1147,6 +1968,109 @@ unsetspec(struct tbl *vp)
 	}
 }
 
+/*
+ * Elements of an indexed array other than [0], which is the variable's
+ * table entry itself.  Elements are table entries without a name (it is
+ * the one of u.base).  Indices below vsize are kept in a vector, others in
+ * a small open addressed hash; the vector grows to cover an index if that
+ * at most doubles it, taking over the hashed elements it then covers.
+ *
+ * The elements of an associative array are entered in a table of their
+ * own, under their key.
+ */
+struct array {
+	struct tbl **vec;	/* vec[i] is element i (vec[0] is unused) */
+	int	vsize;
+	struct tbl **hash;	/* elements with index >= vsize */
+	int	hsize, hcount;
+	int	top;		/* no element above top is set */
+	struct table keys;	/* elements of an associative array */
+};
+
+#define	ADENSE		16	/* indices always kept in the vector */
+#define	AHASH(i, n)	(((unsigned int)(i) * 2654435761U) & ((n) - 1))
+
+static void
+ahashput(struct array *ap, struct tbl *p)
+{
+	unsigned int i;
+
+	for (i = AHASH(p->index, ap->hsize); ap->hash[i] != NULL;
+	    i = (i + 1) & (ap->hsize - 1))
+		;
+	ap->hash[i] = p;
+	ap->hcount++;
+}
+
+/* rebuild the hash with room for n elements, dropping the covered ones */
+static void
+ahashresize(struct array *ap, int n, Area *areap)
+{
+	struct tbl **ohash = ap->hash;
+	int i, osize = ap->hsize;
+
+	for (ap->hsize = 8; ap->hsize * 7 / 10 < n; ap->hsize *= 2)
+		;
+	ap->hash = areallocarray(NULL, ap->hsize, sizeof(struct tbl *), areap);
+	memset(ap->hash, 0, ap->hsize * sizeof(struct tbl *));
+	ap->hcount = 0;
+	for (i = 0; i < osize; i++)
+		if (ohash[i] != NULL) {
+			if (ohash[i]->index < ap->vsize)
+				ap->vec[ohash[i]->index] = ohash[i];
+			else
+				ahashput(ap, ohash[i]);
+		}
+	afree(ohash, areap);
+}
+
+static struct array *
+arrayalloc(struct tbl *vp)
+{
+	struct array *ap;
+
+	ap = vp->u.array = alloc(sizeof(struct array), vp->areap);
+	memset(ap, 0, sizeof(struct array));
+	ktinit(&ap->keys, vp->areap, 0);
+	return ap;
+}
+
+/* slot for element val (> 0) of array vp, created empty if need be */
+static struct tbl **
+arrayslot(struct tbl *vp, int val)
+{
+	struct array *ap = vp->u.array;
+	unsigned int i;
+	int nsize;
+
+	if (ap == NULL)
+		ap = arrayalloc(vp);
+	if (val < ap->vsize)
+		return &ap->vec[val];
+
+	if (val < ADENSE || val / 2 < ap->vsize) {
+		for (nsize = ap->vsize ? ap->vsize : ADENSE; nsize <= val; )
+			nsize *= 2;
+		ap->vec = areallocarray(ap->vec, nsize, sizeof(struct tbl *),
+		    vp->areap);
+		memset(ap->vec + ap->vsize, 0,
+		    (nsize - ap->vsize) * sizeof(struct tbl *));
+		ap->vsize = nsize;
+		if (ap->hcount > 0)
+			ahashresize(ap, ap->hcount, vp->areap);
+		return &ap->vec[val];
+	}
+
+	if (ap->hash == NULL || (ap->hcount + 1) * 10 > ap->hsize * 7)
+		ahashresize(ap, ap->hcount + 1, vp->areap);
+	for (i = AHASH(val, ap->hsize); ap->hash[i] != NULL;
+	    i = (i + 1) & (ap->hsize - 1))
+		if (ap->hash[i]->index == val)
+			return &ap->hash[i];
+	ap->hcount++;
+	return &ap->hash[i];
+}
+
 /*
  * Search for (and possibly create) a table entry starting with
  * vp, indexed by val.
@@ -1154,41 +2078,192 @@ unsetspec(struct tbl *vp)
 static struct tbl *
 arraysearch(struct tbl *vp, int val)
 {
-	struct tbl *prev, *curr, *new;
-	size_t namelen = strlen(vp->name) + 1;
+	struct tbl **pp, *new;
 
 	vp->flag |= ARRAY|DEFINED;
 	vp->index = 0;
 	/* The table entry is always [0] */
 	if (val == 0)
 		return vp;
-	prev = vp;
-	curr = vp->u.array;
-	while (curr && curr->index < val) {
-		prev = curr;
-		curr = curr->u.array;
+	pp = arrayslot(vp, val);
+	if (val > vp->u.array->top)
+		vp->u.array->top = val;
+	if ((new = *pp) != NULL) {
+		if (new->flag&ISSET)
+			return new;
+	} else {
+		new = *pp = tballoc(1);
+		new->name[0] = '\0';
+		new->hval = vp->hval;
+		new->sval = NULL;
 	}
-	if (curr && curr->index == val) {
-		if (curr->flag&ISSET)
-			return curr;
-		else
-			new = curr;
-	} else
-		new = alloc(sizeof(struct tbl) + namelen,
-		    vp->areap);
-	strlcpy(new->name, vp->name, namelen);
-	new->flag = vp->flag & ~(ALLOC|DEFINED|ISSET|SPECIAL);
-	new->type = vp->type;
-	new->areap = vp->areap;
-	new->u2.field = vp->u2.field;
-	new->index = val;
-	if (curr != new) {		/* not reusing old array entry */
-		prev->u.array = new;
-		new->u.array = curr;
+	arrayelem(vp, new, val);
+	return new;
+}
+
+/*
+ * Search for (and possibly create) the element of associative array vp
+ * with key key.  Elements stay DEFINED so the table keeps them.  If peek
+ * is set a missing element is not created, an unset one in ATEMP stands
+ * in for it.
+ */
+static struct tbl *
+assocsearch(struct tbl *vp, const char *key, bool peek)
+{
+	struct array *ap = vp->u.array;
+	struct tbl *new;
+	size_t len;
+
+	if (peek) {
+		if (ap != NULL &&
+		    (new = ktsearch(&ap->keys, key, hash(key))) != NULL)
+			return new;
+		len = strlen(key) + 1;
+		new = alloc(offsetof(struct tbl, name[0]) + len, ATEMP);
+		memcpy(new->name, key, len);
+		new->hval = 0;
+		new->sval = NULL;
+		arrayelem(vp, new, -1);
+		new->flag |= DEFINED;
+		new->areap = ATEMP;
+		return new;
+	}
+	if (ap == NULL)
+		ap = arrayalloc(vp);
+	new = ktenter(&ap->keys, key, hash(key));
+	if (!(new->flag&ISSET)) {
+		arrayelem(vp, new, -1);
+		new->flag |= DEFINED;
 	}
 	return new;
 }
 
+/* remove element vp from its associative array and free it */
+static void
+assocdelete(struct tbl *vp)
+{
+	ktdelete(&vp->u.base->u.array->keys, vp);
+}
+
+/* (re)initialize element p of array vp, taking over its attributes */
+static void
+arrayelem(struct tbl *vp, struct tbl *p, int val)
+{
+	p->flag = vp->flag & ~(ALLOC|DEFINED|ISSET|SPECIAL|SHARED);
+	p->type = vp->type;
+	p->spec = vp->spec;
+	p->areap = vp->areap;
+	p->u2.field = vp->u2.field;
+	p->u.base = vp;
+	vfree(p->sval);
+	p->sval = NULL;
+	p->index = val;
+}
+
+/* Return the index after the last set element of array vp (for a+=(...)) */
+static int
+arraynext(struct tbl *vp)
+{
+	struct array *ap = (vp->flag & ARRAY) ? vp->u.array : NULL;
+	struct tbl *p;
+	unsigned int i;
+
+	for (; ap != NULL && ap->top > 0; ap->top--) {
+		if (ap->top < ap->vsize)
+			p = ap->vec[ap->top];
+		else {
+			p = NULL;
+			if (ap->hash != NULL)
+				for (i = AHASH(ap->top, ap->hsize);
+				    ap->hash[i] != NULL;
+				    i = (i + 1) & (ap->hsize - 1))
+					if (ap->hash[i]->index == ap->top) {
+						p = ap->hash[i];
+						break;
+					}
+		}
+		if (p != NULL && (p->flag & ISSET))
+			return ap->top + 1;
+	}
+	return (vp->flag & ISSET) ? 1 : 0;
+}
+
+static int
+aindexcmp(const void *p1, const void *p2)
+{
+	int i1 = (*(struct tbl **)p1)->index;
+	int i2 = (*(struct tbl **)p2)->index;
+
+	return i1 < i2 ? -1 : i1 > i2;
+}
+
+/*
+ * Return the elements of array vp in index order (starting with vp itself,
+ * which is all there is if it isn't an array), NULL terminated, in ATEMP.
+ * Elements that aren't set are included.  The elements of an associative
+ * array follow in key order.
+ */
+struct tbl **
+arraylist(struct tbl *vp)
+{
+	struct array *ap = (vp->flag & ARRAY) ? vp->u.array : NULL;
+	struct tbl **list, **lp, **hp;
+	int i, n = 1;
+
+	if (ap != NULL && (vp->flag & ASSOC)) {
+		hp = ktsort(&ap->keys);
+		for (lp = hp; *lp != NULL; lp++)
+			;
+		list = areallocarray(NULL, lp - hp + 2, sizeof(struct tbl *),
+		    ATEMP);
+		list[0] = vp;
+		memcpy(list + 1, hp, (lp - hp + 1) * sizeof(struct tbl *));
+		afree(hp, ATEMP);
+		return list;
+	}
+	if (ap != NULL)
+		n += ap->vsize + ap->hcount;
+	lp = list = areallocarray(NULL, n + 1, sizeof(struct tbl *), ATEMP);
+	*lp++ = vp;
+	if (ap != NULL) {
+		for (i = 1; i < ap->vsize; i++)
+			if (ap->vec[i] != NULL)
+				*lp++ = ap->vec[i];
+		hp = lp;
+		for (i = 0; i < ap->hsize; i++)
+			if (ap->hash[i] != NULL)
+				*lp++ = ap->hash[i];
+		qsort(hp, lp - hp, sizeof(struct tbl *), aindexcmp);
+	}
+	*lp = NULL;
+	return list;
+}
+
+/* free the elements of array vp other than [0] */
+static void
+arrayfree(struct tbl *vp)
+{
+	struct array *ap = vp->u.array;
+	struct tbl **list, **lp;
+
+	if (ap == NULL)
+		return;
+	list = arraylist(vp);
+	for (lp = list + 1; *lp != NULL; lp++) {
+		if ((*lp)->flag & ALLOC)
+			vfree((*lp)->val.s);
+		vfree((*lp)->sval);
+		if (!(vp->flag & ASSOC))
+			tbfree(*lp);
+	}
+	afree(list, ATEMP);
+	ktfreeall(&ap->keys);
+	afree(ap->vec, vp->areap);
+	afree(ap->hash, vp->areap);
+	afree(ap, vp->areap);
+	vp->u.array = NULL;
+}
+
 /* Return the length of an array reference (eg, [1+2]) - cp is assumed
  * to point to the open bracket.  Returns 0 if there is no matching closing
  * bracket.
@@ -1224,12 +2299,13 @@ arrayname(const char *str)
 }
 
 /* Set (or overwrite, if !reset) the array variable var to the values in vals.
+ * If append, the values go after the last set element.
  */
 void
-set_array(const char *var, int reset, char **vals)
+set_array(const char *var, int reset, bool append, char **vals)
 {
 	struct tbl *vp, *vq;
-	int i;
+	int i, first = 0;
 
 	/* to get local array, use "typeset foo; set -A foo" */
 	vp = global(var);
@@ -1238,15 +2314,24 @@ set_array(const char *var, int reset, char **vals)
 	if ((vp->flag&RDONLY))
 		errorf("%s: is read only", var);
 	/* This code is quite non-optimal */
-	if (reset > 0)
-		/* trash existing values and attributes */
-		unset(vp, 0);
+	if (append) {
+		if (vp->flag & ASSOC)
+			errorf("%s: is an associative array", var);
+		first = arraynext(vp);
+	} else if (reset > 0)
+		/* trash existing values and attributes (but keep the entry) */
+		clearvar(vp, 0);
 	/* todo: would be nice for assignment to completely succeed or
 	 * completely fail.  Only really effects integer arrays:
 	 * evaluation of some of vals[] may fail...
 	 */
 	for (i = 0; vals[i]; i++) {
-		vq = arraysearch(vp, i);
+		if (first > INT_MAX - i)
+			errorf("%s: subscript %" PRIi64 " out of range",
+			    var, (int64_t)first + i);
+		vq = (vp->flag & ASSOC) ?
+		    assocsearch(vp, u64ton(i, 10), false) :
+		    arraysearch(vp, first + i);
 		/* would be nice to deal with errors here... (see above) */
 		setstr(vq, vals[i], KSH_RETURN_ERROR);
 	}